@@ -23,11 +23,22 @@ pages 37-52, 2012
 */
 
 #include "acp.h"
+#include "object.h"
+#if defined(__x86_64__) || defined(_M_X64)
+#define ACP_X86
+#include <immintrin.h>
+#endif
+#if defined(ACP_X86) && !defined(_MSC_VER)
+#define ACP_TARGET(t) __attribute__((target(t)))
+#else
+#define ACP_TARGET(t)
+#endif
 using namespace acp;
 
 namespace acp {
 
-int qd_round;
+ACP_THREAD int qd_round;
+ACP_THREAD Context context = { 212u, false, 0, false, 0, false, 0ull };
 
 double randomNumber (double rmin, double rmax)
 {
@@ -51,23 +62,64 @@ QValue QValue::divide (const QValue &b, RoundMode round) const
   return QValue(q0, q1, q2, q3);
 }
 
+double Rational::lb () const
+{
+  double d = mpq_get_d(q);
+  Rational r(d);
+  return mpq_cmp(r.q, q) > 0 ? nextafter(d, - DBL_MAX) : d;
+}
+
+double Rational::ub () const
+{
+  double d = mpq_get_d(q);
+  Rational r(d);
+  return mpq_cmp(r.q, q) < 0 ? nextafter(d, DBL_MAX) : d;
+}
+
 EInt * EInt::times (const EInt &b) const
 {
+  if (x) {
+    Rational *r = new Rational;
+    mpq_mul(r->q, x->q, b.x->q);
+    return new EInt(r);
+  }
   if (lm) {
-    bool pflag = um->sign() == -1;
-    MValue sl = pflag ? um->minus() : *lm, su = pflag ? lm->minus() : *um,
-    tl = pflag ? b.um->minus() : *b.lm, tu = pflag ? b.lm->minus() : *b.um;
-    if (sl.sign() == 1) {
-      MValue &l1 = tl.sign() == 1 ? sl : su, &u1 = tu.sign() == 1 ? su : sl;
-      return new EInt(l1.times(tl, GMP_RNDD), u1.times(tu, GMP_RNDU));
+    // Bounds are computed in place from the endpoint products that
+    // realize them, without negated copies of the operands.
+    int ls = lm->sign(), us = um->sign(), bls = b.lm->sign(), bus = b.um->sign();
+    const MValue *l1, *l2, *u1, *u2;
+    EInt *e = new EInt(lm->p);
+    if (ls == 1) {
+      l1 = bls == 1 ? lm : um; l2 = b.lm;
+      u1 = bus == -1 ? lm : um; u2 = b.um;
+    }
+    else if (us == -1) {
+      l1 = bus == -1 ? um : lm; l2 = b.um;
+      u1 = bls == 1 ? um : lm; u2 = b.lm;
+    }
+    else if (bls == 1) {
+      l1 = lm; l2 = b.um;
+      u1 = um; u2 = b.um;
+    }
+    else if (bus == -1) {
+      l1 = um; l2 = b.lm;
+      u1 = lm; u2 = b.lm;
+    }
+    else {
+      MValue t(lm->p);
+      e->lm->mul(*lm, *b.um, GMP_RNDD);
+      t.mul(*um, *b.lm, GMP_RNDD);
+      if (t < *e->lm)
+        e->lm->set(t);
+      e->um->mul(*lm, *b.lm, GMP_RNDU);
+      t.mul(*um, *b.um, GMP_RNDU);
+      if (*e->um < t)
+        e->um->set(t);
+      return e;
     }
-    if (tl.sign() == 1)
-      return new EInt(sl.times(tu, GMP_RNDD), su.times(tu, GMP_RNDU));
-    if (tu.sign() == -1)
-      return new EInt(su.times(tl, GMP_RNDD), sl.times(tl, GMP_RNDU));
-    MValue cl1 = sl.times(tu, GMP_RNDD), cl2 = su.times(tl, GMP_RNDD),
-      cu1 = sl.times(tl, GMP_RNDU), cu2 = su.times(tu, GMP_RNDU);
-    return new EInt(cl1 < cl2 ? cl1 : cl2, cu1 < cu2 ? cu2 : cu1);
+    e->lm->mul(*l1, *l2, GMP_RNDD);
+    e->um->mul(*u1, *u2, GMP_RNDU);
+    return e;
   }
   bool pflag = uq.sign() == -1;
   QValue sl = pflag ? uq.minus() : lq, su = pflag ? lq.minus() : uq,
@@ -85,34 +137,39 @@ EInt * EInt::times (const EInt &b) const
   return new EInt(cl1 < cl2 ? cl1 : cl2, cu1 < cu2 ? cu2 : cu1);
 }
 
+// Division by an exact zero throws PrecisionException: there is no
+// higher precision to go to.
 EInt * EInt::divide (const EInt &b) const
 {
+  if (x) {
+    if (mpq_sgn(b.x->q) == 0)
+      throw precisionException;
+    Rational *r = new Rational;
+    mpq_div(r->q, x->q, b.x->q);
+    return new EInt(r);
+  }
   int as = sign(), bs = b.sign();
   if (lm) {
-    if (bs == 1)
-      switch (as) {
-      case 1:
-	return new EInt(lm->divide(*b.um, GMP_RNDD), um->divide(*b.lm, GMP_RNDU));
-      case 0:
-	return new EInt(lm->divide(*b.um, GMP_RNDD), um->divide(*b.um, GMP_RNDU));
-      case -1:
-	return new EInt(lm->divide(*b.lm, GMP_RNDD), um->divide(*b.um, GMP_RNDU));
-      }
-    switch (as) {
-    case 1:
-      return new EInt(um->divide(*b.um, GMP_RNDD), lm->divide(*b.lm, GMP_RNDU));
-    case 0:
-      return new EInt(um->divide(*b.lm, GMP_RNDD), lm->divide(*b.lm, GMP_RNDU));
-    case -1:
-      return new EInt(um->divide(*b.lm, GMP_RNDD), lm->divide(*b.um, GMP_RNDU));
+    const MValue *dl, *du;
+    if (bs == 1) {
+      dl = as == 1 ? b.um : b.lm;
+      du = as == -1 ? b.um : b.lm;
     }
+    else {
+      dl = as == -1 ? b.lm : b.um;
+      du = as == 1 ? b.lm : b.um;
+    }
+    EInt *e = new EInt(lm->p);
+    e->lm->div(bs == 1 ? *lm : *um, *dl, GMP_RNDD);
+    e->um->div(bs == 1 ? *um : *lm, *du, GMP_RNDU);
+    return e;
   }
   if (bs == 1)
     switch (as) {
     case 1:
       return new EInt(lq.divide(b.uq, RoundDown), uq.divide(b.lq, RoundUp));
     case 0:
-      return new EInt(lq.divide(b.uq, RoundDown), uq.divide(b.uq, RoundUp));
+      return new EInt(lq.divide(b.lq, RoundDown), uq.divide(b.lq, RoundUp));
     case -1:
       return new EInt(lq.divide(b.lq, RoundDown), uq.divide(b.uq, RoundUp));
     }
@@ -120,22 +177,235 @@ EInt * EInt::divide (const EInt &b) const
   case 1:
     return new EInt(uq.divide(b.uq, RoundDown), lq.divide(b.lq, RoundUp));
   case 0:
-    return new EInt(uq.divide(b.lq, RoundDown), lq.divide(b.lq, RoundUp));
+    return new EInt(uq.divide(b.uq, RoundDown), lq.divide(b.uq, RoundUp));
   case -1:
     return new EInt(uq.divide(b.lq, RoundDown), lq.divide(b.uq, RoundUp));
   }
   return 0;
 }
 
+EInt * EInt::divide (double b) const
+{
+  assert(x);
+  if (b == 0.0)
+    throw precisionException;
+  Rational *r = new Rational(b);
+  mpq_div(r->q, x->q, r->q);
+  return new EInt(r);
+}
+
+// Batched a*b - c*d over double intervals.  Each product's bounds are
+// the min and max of its four endpoint products; every rounding is
+// widened as in Parameter::down and Parameter::up.  The vector versions
+// run 2, 4 or 8 lanes at a time and finish with the scalar one.
+
+static const double widenFactor = 0.5*DBL_EPSILON*(1.0 + DBL_EPSILON);
+
+static inline double widenDown (double x)
+{
+  return x - std::max(fabs(x), widenFloor)*widenFactor;
+}
+
+static inline double widenUp (double x)
+{
+  return x + std::max(fabs(x), widenFloor)*widenFactor;
+}
+
+static void diffProductsScalar (int i, int n, const Intervals &a, const Intervals &b,
+                                const Intervals &c, const Intervals &d, const Intervals &r)
+{
+  for (; i < n; ++i) {
+    double p0 = a.l[i]*b.l[i], p1 = a.l[i]*b.u[i], p2 = a.u[i]*b.l[i], p3 = a.u[i]*b.u[i];
+    double q0 = c.l[i]*d.l[i], q1 = c.l[i]*d.u[i], q2 = c.u[i]*d.l[i], q3 = c.u[i]*d.u[i];
+    double pl = widenDown(std::min(std::min(p0, p1), std::min(p2, p3)));
+    double pu = widenUp(std::max(std::max(p0, p1), std::max(p2, p3)));
+    double ql = widenDown(std::min(std::min(q0, q1), std::min(q2, q3)));
+    double qu = widenUp(std::max(std::max(q0, q1), std::max(q2, q3)));
+    r.l[i] = widenDown(pl - qu);
+    r.u[i] = widenUp(pu - ql);
+  }
+}
+
+#ifdef ACP_X86
+static void diffProductsSSE2 (int n, Intervals a, Intervals b, Intervals c, Intervals d, Intervals r)
+{
+  const __m128d absMask = _mm_castsi128_pd(_mm_set1_epi64x(0x7fffffffffffffffLL));
+  const __m128d f = _mm_set1_pd(widenFactor), e = _mm_set1_pd(widenFloor);
+#define ACP_WIDEN(x) _mm_mul_pd(_mm_max_pd(_mm_and_pd(x, absMask), e), f)
+  int i = 0;
+  for (; i + 2 <= n; i += 2) {
+    __m128d al = _mm_loadu_pd(a.l + i), au = _mm_loadu_pd(a.u + i);
+    __m128d bl = _mm_loadu_pd(b.l + i), bu = _mm_loadu_pd(b.u + i);
+    __m128d cl = _mm_loadu_pd(c.l + i), cu = _mm_loadu_pd(c.u + i);
+    __m128d dl = _mm_loadu_pd(d.l + i), du = _mm_loadu_pd(d.u + i);
+    __m128d p0 = _mm_mul_pd(al, bl), p1 = _mm_mul_pd(al, bu), p2 = _mm_mul_pd(au, bl), p3 = _mm_mul_pd(au, bu);
+    __m128d q0 = _mm_mul_pd(cl, dl), q1 = _mm_mul_pd(cl, du), q2 = _mm_mul_pd(cu, dl), q3 = _mm_mul_pd(cu, du);
+    __m128d pl = _mm_min_pd(_mm_min_pd(p0, p1), _mm_min_pd(p2, p3));
+    __m128d pu = _mm_max_pd(_mm_max_pd(p0, p1), _mm_max_pd(p2, p3));
+    __m128d ql = _mm_min_pd(_mm_min_pd(q0, q1), _mm_min_pd(q2, q3));
+    __m128d qu = _mm_max_pd(_mm_max_pd(q0, q1), _mm_max_pd(q2, q3));
+    pl = _mm_sub_pd(pl, ACP_WIDEN(pl));
+    pu = _mm_add_pd(pu, ACP_WIDEN(pu));
+    ql = _mm_sub_pd(ql, ACP_WIDEN(ql));
+    qu = _mm_add_pd(qu, ACP_WIDEN(qu));
+    __m128d rl = _mm_sub_pd(pl, qu), ru = _mm_sub_pd(pu, ql);
+    _mm_storeu_pd(r.l + i, _mm_sub_pd(rl, ACP_WIDEN(rl)));
+    _mm_storeu_pd(r.u + i, _mm_add_pd(ru, ACP_WIDEN(ru)));
+  }
+#undef ACP_WIDEN
+  diffProductsScalar(i, n, a, b, c, d, r);
+}
+
+ACP_TARGET("avx")
+static void diffProductsAVX (int n, Intervals a, Intervals b, Intervals c, Intervals d, Intervals r)
+{
+  const __m256d absMask = _mm256_castsi256_pd(_mm256_set1_epi64x(0x7fffffffffffffffLL));
+  const __m256d f = _mm256_set1_pd(widenFactor), e = _mm256_set1_pd(widenFloor);
+#define ACP_WIDEN(x) _mm256_mul_pd(_mm256_max_pd(_mm256_and_pd(x, absMask), e), f)
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256d al = _mm256_loadu_pd(a.l + i), au = _mm256_loadu_pd(a.u + i);
+    __m256d bl = _mm256_loadu_pd(b.l + i), bu = _mm256_loadu_pd(b.u + i);
+    __m256d cl = _mm256_loadu_pd(c.l + i), cu = _mm256_loadu_pd(c.u + i);
+    __m256d dl = _mm256_loadu_pd(d.l + i), du = _mm256_loadu_pd(d.u + i);
+    __m256d p0 = _mm256_mul_pd(al, bl), p1 = _mm256_mul_pd(al, bu), p2 = _mm256_mul_pd(au, bl), p3 = _mm256_mul_pd(au, bu);
+    __m256d q0 = _mm256_mul_pd(cl, dl), q1 = _mm256_mul_pd(cl, du), q2 = _mm256_mul_pd(cu, dl), q3 = _mm256_mul_pd(cu, du);
+    __m256d pl = _mm256_min_pd(_mm256_min_pd(p0, p1), _mm256_min_pd(p2, p3));
+    __m256d pu = _mm256_max_pd(_mm256_max_pd(p0, p1), _mm256_max_pd(p2, p3));
+    __m256d ql = _mm256_min_pd(_mm256_min_pd(q0, q1), _mm256_min_pd(q2, q3));
+    __m256d qu = _mm256_max_pd(_mm256_max_pd(q0, q1), _mm256_max_pd(q2, q3));
+    pl = _mm256_sub_pd(pl, ACP_WIDEN(pl));
+    pu = _mm256_add_pd(pu, ACP_WIDEN(pu));
+    ql = _mm256_sub_pd(ql, ACP_WIDEN(ql));
+    qu = _mm256_add_pd(qu, ACP_WIDEN(qu));
+    __m256d rl = _mm256_sub_pd(pl, qu), ru = _mm256_sub_pd(pu, ql);
+    _mm256_storeu_pd(r.l + i, _mm256_sub_pd(rl, ACP_WIDEN(rl)));
+    _mm256_storeu_pd(r.u + i, _mm256_add_pd(ru, ACP_WIDEN(ru)));
+  }
+#undef ACP_WIDEN
+  diffProductsScalar(i, n, a, b, c, d, r);
+}
+
+ACP_TARGET("avx512f")
+static void diffProductsAVX512 (int n, Intervals a, Intervals b, Intervals c, Intervals d, Intervals r)
+{
+  const __m512d f = _mm512_set1_pd(widenFactor), e = _mm512_set1_pd(widenFloor);
+#define ACP_WIDEN(x) _mm512_mul_pd(_mm512_max_pd(_mm512_abs_pd(x), e), f)
+  int i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m512d al = _mm512_loadu_pd(a.l + i), au = _mm512_loadu_pd(a.u + i);
+    __m512d bl = _mm512_loadu_pd(b.l + i), bu = _mm512_loadu_pd(b.u + i);
+    __m512d cl = _mm512_loadu_pd(c.l + i), cu = _mm512_loadu_pd(c.u + i);
+    __m512d dl = _mm512_loadu_pd(d.l + i), du = _mm512_loadu_pd(d.u + i);
+    __m512d p0 = _mm512_mul_pd(al, bl), p1 = _mm512_mul_pd(al, bu), p2 = _mm512_mul_pd(au, bl), p3 = _mm512_mul_pd(au, bu);
+    __m512d q0 = _mm512_mul_pd(cl, dl), q1 = _mm512_mul_pd(cl, du), q2 = _mm512_mul_pd(cu, dl), q3 = _mm512_mul_pd(cu, du);
+    __m512d pl = _mm512_min_pd(_mm512_min_pd(p0, p1), _mm512_min_pd(p2, p3));
+    __m512d pu = _mm512_max_pd(_mm512_max_pd(p0, p1), _mm512_max_pd(p2, p3));
+    __m512d ql = _mm512_min_pd(_mm512_min_pd(q0, q1), _mm512_min_pd(q2, q3));
+    __m512d qu = _mm512_max_pd(_mm512_max_pd(q0, q1), _mm512_max_pd(q2, q3));
+    pl = _mm512_sub_pd(pl, ACP_WIDEN(pl));
+    pu = _mm512_add_pd(pu, ACP_WIDEN(pu));
+    ql = _mm512_sub_pd(ql, ACP_WIDEN(ql));
+    qu = _mm512_add_pd(qu, ACP_WIDEN(qu));
+    __m512d rl = _mm512_sub_pd(pl, qu), ru = _mm512_sub_pd(pu, ql);
+    _mm512_storeu_pd(r.l + i, _mm512_sub_pd(rl, ACP_WIDEN(rl)));
+    _mm512_storeu_pd(r.u + i, _mm512_add_pd(ru, ACP_WIDEN(ru)));
+  }
+#undef ACP_WIDEN
+  diffProductsScalar(i, n, a, b, c, d, r);
+}
+
+static DiffProductsKernel selectDiffProducts ()
+{
+#if defined(_MSC_VER)
+  int info[4];
+  __cpuid(info, 1);
+  bool osxsave = (info[2] & (1 << 27)) != 0, avx = (info[2] & (1 << 28)) != 0;
+  unsigned long long xcr0 = osxsave ? _xgetbv(0) : 0;
+  if (!avx || (xcr0 & 6) != 6)
+    return diffProductsSSE2;
+  __cpuidex(info, 7, 0);
+  if ((info[1] & (1 << 16)) && (xcr0 & 0xe6) == 0xe6)
+    return diffProductsAVX512;
+  return diffProductsAVX;
+#else
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f"))
+    return diffProductsAVX512;
+  if (__builtin_cpu_supports("avx"))
+    return diffProductsAVX;
+  return diffProductsSSE2;
+#endif
+}
+#else
+static void diffProductsPortable (int n, Intervals a, Intervals b, Intervals c, Intervals d, Intervals r)
+{
+  diffProductsScalar(0, n, a, b, c, d, r);
+}
+
+static DiffProductsKernel selectDiffProducts ()
+{
+  return diffProductsPortable;
+}
+#endif
+
+DiffProductsKernel diffProductsBatch = selectDiffProducts();
+
+ACP_THREAD BlockPool eintPool = { 0 }, mvaluePool = { 0 };
+
+// Initialized mpfr limbs waiting for reuse, one stack per precision
+// and per thread.
+static const int maxLimbPools = 8, maxPooledLimbs = 64;
+
+struct LimbPool {
+  unsigned int p;
+  int n;
+  __mpfr_struct limbs[maxPooledLimbs];
+};
+
+static ACP_THREAD LimbPool limbPools[maxLimbPools];
+
+// 0 if all the pools are taken by other precisions.
+static LimbPool * limbPool (unsigned int p)
+{
+  for (int i = 0; i < maxLimbPools; ++i) {
+    if (limbPools[i].p == p)
+      return &limbPools[i];
+    if (limbPools[i].p == 0) {
+      limbPools[i].p = p;
+      return &limbPools[i];
+    }
+  }
+  return 0;
+}
+
+void MValue::acquire ()
+{
+  LimbPool *pool = limbPool(p);
+  if (pool == 0 || pool->n == 0)
+    mpfr_init2(m, p);
+  else
+    m[0] = pool->limbs[--pool->n];
+}
+
+void MValue::release ()
+{
+  LimbPool *pool = limbPool(p);
+  if (pool == 0 || pool->n == maxPooledLimbs)
+    mpfr_clear(m);
+  else
+    pool->limbs[pool->n++] = m[0];
+}
+
 MValue::MValue (double x, unsigned int ip) : p(ip) 
 { 
-  mpfr_init2(m, p);
+  acquire();
   mpfr_set_d(m, x, GMP_RNDN);
 }
 
 MValue::MValue (const MValue &v) : p(v.p) 
 { 
-  mpfr_init2(m, v.p); 
+  acquire();
   mpfr_set(m, v.m, GMP_RNDN); 
 }
 
@@ -200,25 +470,68 @@ bool MValue::operator< (const MValue &b)  const
 
 double Parameter::delta = std::pow(2.0, -27);
 const double Parameter::sentinel = 1e20;
-unsigned int Parameter::highPrecision = 212u;
-unsigned int Parameter::maxPrecision = 848u;
-bool Parameter::enabled = false;
-bool Parameter::quadDouble = false;
-unsigned int Parameter::controlWord = 0;
+unsigned int Parameter::maxPrecision = 212u;
+unsigned long long Parameter::seed = 0ull;
 SignException signException;
 PrecisionException precisionException;
+bool Predicate::concurrent = false;
+bool Object::memoize = true;
+ACP_THREAD MemoEntry *memoTable;
+std::atomic<unsigned int> memoGeneration(1);
+ACP_THREAD unsigned long long memoWrites;
+RWLock escalationLock;
+
+// Zero-initialized, so that static initializers may add to it in any
+// order.
+static void (*threadReleases[maxThreadReleases]) ();
+static int nThreadReleases;
+
+void atThreadRelease (void (*release) ())
+{
+  assert(nThreadReleases < maxThreadReleases);
+  threadReleases[nThreadReleases++] = release;
+}
+
+void releaseThreadMemory ()
+{
+  // Before the memo table, as freeing Objects drops memos.
+  for (int i = 0; i < nThreadReleases; ++i)
+    threadReleases[i]();
+  // The memos hold EInts, which go back to the block lists.
+  delete [] memoTable;
+  memoTable = 0;
+  eintPool.clear();
+  mvaluePool.clear();
+  for (int i = 0; i < maxLimbPools; ++i) {
+    LimbPool &pool = limbPools[i];
+    for (int j = 0; j < pool.n; ++j)
+      mpfr_clear(&pool.limbs[j]);
+    pool.p = 0;
+    pool.n = 0;
+  }
+}
+
+void Object::forgetMemos (const char *begin, const char *end)
+{
+  if (memoTable == 0)
+    return;
+  for (int i = 0; i < memoSize; ++i) {
+    const char *o = (const char *) memoTable[i].object;
+    if (o >= begin && o < end)
+      memoTable[i].object = 0;
+  }
+}
 
 Parameter Parameter::sqrt () const {
   assert(sign() > 0);
+  assert(l != sentinel || !u.e->x);
   double myUB = ub();
   double myLB = lb();
   double s = ::sqrt((myUB + myLB) / 2);
-  if (l == sentinel)
-    enable();
-  double s1 = myUB / s;
-  double s2 = myUB / s1;
+  double s1 = up(myUB / s);
+  double s2 = up(myUB / s1);
   double yr = s1 > s2 ? s1 : s2;
-  double yl = -((-myLB) / yr);
+  double yl = down(myLB / yr);
   Parameter y(yl, yr);
   if (l == sentinel)
     y.increasePrecision();
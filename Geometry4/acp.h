@@ -29,17 +29,58 @@ pages 37-52, 2012
 #include <mpfr.h>
 #include <assert.h>
 #include <iostream>
-#include <fenv.h>
 #include <exception>
 #include <math.h>
 #include <algorithm>
 #include <float.h>
+#include <string.h>
 #include <qd/qd_real.h>
 
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define ACP_THREAD __declspec(thread)
+#else
+#define ACP_THREAD __thread
+#endif
+
 namespace acp {
 
 double randomNumber (double rmin, double rmax);
 
+// Magnitudes below this are widened as if they were this large, so
+// that outward rounding never does arithmetic on subnormals, which is
+// very slow on x86.  2^-969.
+static const double widenFloor = 2.0*DBL_MIN/DBL_EPSILON;
+
+// Lower and upper bounds of an array of double intervals.
+struct Intervals {
+  double *l, *u;
+};
+
+// r[i] = a[i]*b[i] - c[i]*d[i] for i < n, rounded outward.  For
+// filters that test many determinants at once.  Points to the widest
+// vector version the CPU supports.
+typedef void (*DiffProductsKernel) (int n, Intervals a, Intervals b, Intervals c, Intervals d, Intervals r);
+extern DiffProductsKernel diffProductsBatch;
+
+// Precision state of the calling thread, so that predicates may run
+// in several threads at once (see Predicate::concurrent).
+struct Context {
+  unsigned int highPrecision;
+  bool quadDouble;
+  unsigned int controlWord;
+  // Inside a Predicate that holds the escalation lock.
+  bool locked;
+  // Number of Predicates being evaluated.  While nonzero, a sign
+  // failure sets failed instead of throwing.
+  int predicates;
+  bool failed;
+  // Number of Parameters perturbed by Parameter(double).
+  unsigned long long perturbations;
+};
+
+extern ACP_THREAD Context context;
+
 class SignException : public std::exception {
  public:
   virtual const char* what() const throw() {
@@ -47,10 +88,11 @@ class SignException : public std::exception {
   }
 };
 
+// Thrown for division by a value that is exactly zero.
 class PrecisionException : public std::exception {
  public:
   virtual const char* what() const throw() {
-    return "Maximum precision exceeded";
+    return "Division by zero";
   }
 };
 
@@ -104,12 +146,50 @@ class QValue {
   qd_real r;
 };
 
+// Free list of fixed-size blocks.  The escalation path allocates and
+// frees EInt and MValue objects at a high rate.  One list per thread;
+// a block freed by another thread joins that thread's list.
+struct BlockPool {
+  void * allocate (size_t size) {
+    if (!head)
+      return ::operator new(size < sizeof(void *) ? sizeof(void *) : size);
+    void *b = head;
+    head = *(void **) b;
+    return b;
+  }
+  void release (void *b) { *(void **) b = head; head = b; }
+  void clear () {
+    while (head) {
+      void *b = head;
+      head = *(void **) b;
+      ::operator delete(b);
+    }
+  }
+
+  void *head;
+};
+
+extern ACP_THREAD BlockPool eintPool, mvaluePool;
+
+// Free the calling thread's memo table, block lists and mpfr limb
+// pools, and whatever the functions given to atThreadRelease free.
+// They are thread-local and not freed when the thread exits, so a
+// thread that has evaluated predicates should call this before it
+// ends, or they leak.  The thread can go on evaluating afterwards.
+void releaseThreadMemory ();
+
+// Have releaseThreadMemory also call release, which frees thread-local
+// storage of code built on ACP, such as the query arena.  For static
+// initializers; at most maxThreadReleases of them.
+static const int maxThreadReleases = 8;
+void atThreadRelease (void (*release) ());
+
 class MValue {
  public:
-  MValue (unsigned int ip) : p(ip) { mpfr_init2(m, p); }
+  MValue (unsigned int ip) : p(ip) { acquire(); }
   MValue (double x, unsigned int ip);
   MValue (const MValue &v);
-  ~MValue () { mpfr_clear(m); }
+  ~MValue () { release(); }
   double value () const { return mpfr_get_d(m, GMP_RNDN); }
   MValue plus (const MValue &b, mpfr_rnd_t round) const;
   MValue plus (double b, mpfr_rnd_t round) const;
@@ -120,75 +200,219 @@ class MValue {
   MValue divide (const MValue &b, mpfr_rnd_t round) const;
   int sign () const;
   bool operator< (const MValue &b)  const;
+
+  // In-place forms: this = a op b, reusing the storage of this.
+  void set (const MValue &a) { mpfr_set(m, a.m, GMP_RNDN); }
+  void add (const MValue &a, const MValue &b, mpfr_rnd_t round) { mpfr_add(m, a.m, b.m, round); }
+  void add (const MValue &a, double b, mpfr_rnd_t round) { mpfr_add_d(m, a.m, b, round); }
+  void sub (const MValue &a, const MValue &b, mpfr_rnd_t round) { mpfr_sub(m, a.m, b.m, round); }
+  void mul (const MValue &a, const MValue &b, mpfr_rnd_t round) { mpfr_mul(m, a.m, b.m, round); }
+  void mul (const MValue &a, double b, mpfr_rnd_t round) { mpfr_mul_d(m, a.m, b, round); }
+  void div (const MValue &a, const MValue &b, mpfr_rnd_t round) { mpfr_div(m, a.m, b.m, round); }
+  void neg (const MValue &a) { mpfr_neg(m, a.m, GMP_RNDN); }
+
+  static void * operator new (size_t size) { return mvaluePool.allocate(size); }
+  static void operator delete (void *b) { mvaluePool.release(b); }
  
   mpfr_t m;
   unsigned int p;
+
+ private:
+  // mpfr limbs are recycled by precision instead of going through
+  // mpfr_init2/mpfr_clear each time.
+  void acquire ();
+  void release ();
+};
+
+// Exact rational value, for the last level of precision.
+class Rational {
+ public:
+  Rational () { mpq_init(q); }
+  Rational (double x) { mpq_init(q); mpq_set_d(q, x); }
+  Rational (const Rational &r) { mpq_init(q); mpq_set(q, r.q); }
+  ~Rational () { mpq_clear(q); }
+
+  // Nearest doubles below and above.
+  double lb () const;
+  double ub () const;
+
+  mpq_t q;
+
+ private:
+  void operator= (const Rational &r);
 };
 
+// Interval of quad-double (lm == 0, x == 0) or mpfr (lm != 0) bounds,
+// or an exact rational value (x != 0).
 class EInt {
  public:
   EInt (const QValue &l, const QValue &u) 
-    : refCnt(1), lq(l), uq(u), lm(0), um(0) {}
+    : refCnt(1), lq(l), uq(u), lm(0), um(0), x(0) {}
   EInt (const MValue &l, const MValue &u) 
-    : refCnt(1), lm(new MValue(l)), um(new MValue(u)) {}
-  ~EInt () { if (lm) { delete lm; delete um; } }
-  void incRef () { refCnt++; }
-  void decRef () { if (--refCnt == 0) delete this; }
+    : refCnt(1), lm(new MValue(l)), um(new MValue(u)), x(0) {}
+  // Uninitialized bounds of precision p, to be computed in place.
+  EInt (unsigned int p) 
+    : refCnt(1), lm(new MValue(p)), um(new MValue(p)), x(0) {}
+  // Takes ownership of r.
+  EInt (Rational *r)
+    : refCnt(1), lm(0), um(0), x(r) {}
+  ~EInt () { if (lm) { delete lm; delete um; } delete x; }
+  // Shared Parameters may be copied and released in several threads.
+#if defined(_MSC_VER)
+  void incRef () { _InterlockedIncrement(&refCnt); }
+  void decRef () { if (_InterlockedDecrement(&refCnt) == 0) delete this; }
+#else
+  void incRef () { __sync_add_and_fetch(&refCnt, 1); }
+  void decRef () { if (__sync_sub_and_fetch(&refCnt, 1) == 0) delete this; }
+#endif
+
+  static void * operator new (size_t size) { return eintPool.allocate(size); }
+  static void operator delete (void *b) { eintPool.release(b); }
 
   double intervalWidth () const { 
+    if (x)
+      return 0.0;
     return lm ? um->minus(*lm, GMP_RNDN).value()
       : uq.minus(lq, RoundNearest).value();
   }
 
   double lb () const {
+    if (x)
+      return x->lb();
     if (lm)
       return mpfr_get_d(lm->m, GMP_RNDD);
     return lq.r[1] >= 0.0 ? lq.r[0] : nextafter(lq.r[0], - DBL_MAX);
   }
 
   double ub () const {
+    if (x)
+      return x->ub();
     if (lm)
       return mpfr_get_d(um->m, GMP_RNDU);
     return uq.r[1] <= 0.0 ? uq.r[0] : nextafter(uq.r[0], DBL_MAX);
   }
 
   EInt * plus (const EInt &b) const {
-    if (lm)
-      return new EInt(lm->plus(*b.lm, GMP_RNDD), um->plus(*b.um, GMP_RNDU));
+    if (x) {
+      Rational *r = new Rational;
+      mpq_add(r->q, x->q, b.x->q);
+      return new EInt(r);
+    }
+    if (lm) {
+      EInt *e = new EInt(lm->p);
+      e->lm->add(*lm, *b.lm, GMP_RNDD);
+      e->um->add(*um, *b.um, GMP_RNDU);
+      return e;
+    }
     return new EInt(lq.plus(b.lq, RoundDown), uq.plus(b.uq, RoundUp));
   }
 
   EInt * plus (double b) const {
-    if (lm)
-      return new EInt(lm->plus(b, GMP_RNDD), um->plus(b, GMP_RNDU));
+    if (x) {
+      Rational *r = new Rational(b);
+      mpq_add(r->q, x->q, r->q);
+      return new EInt(r);
+    }
+    if (lm) {
+      EInt *e = new EInt(lm->p);
+      e->lm->add(*lm, b, GMP_RNDD);
+      e->um->add(*um, b, GMP_RNDU);
+      return e;
+    }
     return new EInt(lq.plus(b, RoundDown), uq.plus(b, RoundUp));
   }
 
   EInt * minus (const EInt &b) const {
-    if (lm)
-      return new EInt(lm->minus(*b.um, GMP_RNDD), um->minus(*b.lm, GMP_RNDU));
+    if (x) {
+      Rational *r = new Rational;
+      mpq_sub(r->q, x->q, b.x->q);
+      return new EInt(r);
+    }
+    if (lm) {
+      EInt *e = new EInt(lm->p);
+      e->lm->sub(*lm, *b.um, GMP_RNDD);
+      e->um->sub(*um, *b.lm, GMP_RNDU);
+      return e;
+    }
     return new EInt(lq.minus(b.uq, RoundDown), uq.minus(b.lq, RoundUp));
   }
 
   EInt * minus () const { 
-    if (lm)
-      return new EInt(um->minus(), lm->minus());
+    if (x) {
+      Rational *r = new Rational;
+      mpq_neg(r->q, x->q);
+      return new EInt(r);
+    }
+    if (lm) {
+      EInt *e = new EInt(lm->p);
+      e->lm->neg(*um);
+      e->um->neg(*lm);
+      return e;
+    }
     return new EInt(uq.minus(), lq.minus()); 
   }
 
+  // In place: this += b, this -= b.  Only for an unshared EInt.
+  void add (const EInt &b) {
+    if (x)
+      mpq_add(x->q, x->q, b.x->q);
+    else if (lm) {
+      lm->add(*lm, *b.lm, GMP_RNDD);
+      um->add(*um, *b.um, GMP_RNDU);
+    }
+    else {
+      lq = lq.plus(b.lq, RoundDown);
+      uq = uq.plus(b.uq, RoundUp);
+    }
+  }
+
+  void sub (const EInt &b) {
+    if (x)
+      mpq_sub(x->q, x->q, b.x->q);
+    else if (lm) {
+      if (&b == this) {
+        MValue d(lm->p);
+        d.sub(*um, *lm, GMP_RNDU);
+        lm->neg(d);
+        um->set(d);
+        return;
+      }
+      lm->sub(*lm, *b.um, GMP_RNDD);
+      um->sub(*um, *b.lm, GMP_RNDU);
+    }
+    else {
+      QValue l = lq.minus(b.uq, RoundDown);
+      uq = uq.minus(b.lq, RoundUp);
+      lq = l;
+    }
+  }
+
   EInt * times (const EInt &b) const;
 
   EInt * times (double b) const {
-    if (lm)
-      return b > 0.0 ? new EInt(lm->times(b, GMP_RNDD), um->times(b, GMP_RNDU))
-      : new EInt(um->times(b, GMP_RNDD), lm->times(b, GMP_RNDU));
+    if (x) {
+      Rational *r = new Rational(b);
+      mpq_mul(r->q, x->q, r->q);
+      return new EInt(r);
+    }
+    if (lm) {
+      EInt *e = new EInt(lm->p);
+      e->lm->mul(b > 0.0 ? *lm : *um, b, GMP_RNDD);
+      e->um->mul(b > 0.0 ? *um : *lm, b, GMP_RNDU);
+      return e;
+    }
     return b > 0.0 ? new EInt(lq.times(b, RoundDown), uq.times(b, RoundUp))
       : new EInt(uq.times(b, RoundDown), lq.times(b, RoundUp));
   }
 
   EInt * divide (const EInt &b) const;
 
+  // Exact only.
+  EInt * divide (double b) const;
+
   int sign () const {
+    if (x)
+      return mpq_sgn(x->q);
     if (lm) {
       if (lm->sign() == 1) return 1;
       if (um->sign() == -1) return -1;
@@ -200,27 +424,39 @@ class EInt {
   }
 
   EInt * mid () const {
+    if (x)
+      return new EInt(new Rational(*x));
     if (lm) {
-      MValue m = lm->plus(*um, GMP_RNDN).times(0.5, GMP_RNDN);
-      return new EInt(m, m);
+      EInt *e = new EInt(lm->p);
+      e->lm->add(*lm, *um, GMP_RNDN);
+      e->lm->mul(*e->lm, 0.5, GMP_RNDN);
+      e->um->set(*e->lm);
+      return e;
     }
     QValue m = lq.plus(uq, RoundNearest).times(0.5, RoundNearest);
     return new EInt(m, m);
   }
 
   bool subset (const EInt &b) const {
+    if (x)
+      return false;
     if (lm)
       return !(*lm < *b.lm) && !(*b.um < *um) && (*b.lm < *lm || *um < *b.um);
     return !(lq < b.lq) && !(b.uq < uq) && (b.lq < lq || uq < b.uq);
   }
 
   EInt * interval (const EInt &b) const {
+    assert(!x);
     if (lm)
       return new EInt(*lm, *b.um);
     return new EInt(lq, b.uq);
   }
 
   EInt * intersect (const EInt &b) const {
+    if (x) {
+      assert(mpq_equal(x->q, b.x->q));
+      return new EInt(new Rational(*x));
+    }
     if (lm) {
       assert(!(*um < *b.lm && *b.um < *lm));
       MValue *l = *lm < *b.lm ? b.lm : lm;
@@ -235,9 +471,10 @@ class EInt {
     }
   }
 
-  unsigned int refCnt;
+  volatile long refCnt;
   QValue lq, uq;
   MValue *lm, *um;
+  Rational *x;
 };
 
 class Object;
@@ -259,31 +496,76 @@ class Parameter {
   // Perturbation magnitude.
   static double delta; // default is 2^{-26}
 
-  // Maximum allowed precision.  Default is 848 bits.
+  // Precision past which a sign that is still undetermined is
+  // evaluated exactly, the next doubling being the estimate of the bits
+  // it needs.  Default is 212 bits.  The predicates are of low degree
+  // in perturbed doubles, so a sign that quad-double precision cannot
+  // settle is almost surely exactly 0, which no mpfr precision settles:
+  // it goes straight to exact evaluation without recalculating at 424
+  // and 848 bits.  Raise it to try mpfr first for predicates of higher
+  // degree.
   static unsigned int maxPrecision;
 
-  // Call Parameter::enable() before using ACP
-  static void enable () { 
-    if (!enabled) { enabled = true; fesetround(FE_UPWARD); }
-  }
+  // Value of context.highPrecision for exact rational evaluation.
+  static const unsigned int exactPrecision = ~0u;
 
-  // Call Parameter::disable() before non-ACP calculations.
-  static void disable () { 
-    if (enabled) { enabled = false; fesetround(FE_TONEAREST); }
-  }
+  // ACP works in the default round-to-nearest mode: interval bounds
+  // are rounded outward in software (see down and up).  enable() and
+  // disable() no longer change the rounding mode and are kept for
+  // existing callers.
+  static void enable () {}
+  static void disable () {}
 
   Parameter () : l(0.0) { u.r = 0.0; }
 
   // Should be zero only if created by zero-argument constructor.
   bool uninitialized () const { return l == 0.0 && u.r == 0.0; }
 
-  // Construct from double.  Will be perturbed.
+  // True if the value is known exactly as the double lb(), as for a
+  // perturbed input at double precision.
+  bool exact () const { return l != sentinel && l == u.r; }
+
+  // Construct from double.  Will be perturbed, by an amount that
+  // depends on seed, x, and how many Parameters this thread has
+  // perturbed so far.  The same inputs read in the same order by one
+  // thread get the same perturbation every run, but not inputs read in
+  // another order or spread over threads.  Those go in by id instead:
+  // through input, InputPoint(x, y, id), PointStore, or the loaders.
   Parameter (double x) {
-    l = u.r = x + delta*(1.0 + fabs(x))*randomNumber(-1.0, 1.0);
+    l = u.r = perturb(x, hash(context.perturbations++ ^ hash(bits(x))));
+  }
+
+  // Input x with a caller-chosen id, such as its position in the input.
+  // The perturbation depends only on seed, x, and id, so inputs may be
+  // created in any order and in any thread.
+  static Parameter input (double x, unsigned long long id) {
+    double p = perturb(x, hash(id ^ hash(bits(x))));
+    return Parameter(p, p);
+  }
+
+  // Seed of the perturbation.  reseed also restarts the count of
+  // perturbed Parameters in the calling thread.
+  static unsigned long long seed;
+  static void reseed (unsigned long long s) {
+    seed = s;
+    context.perturbations = 0;
+  }
+
+  // splitmix64 finalizer of h and seed.  Also for other choices that
+  // are to be the same every run, as of the sample externalBuild takes.
+  static unsigned long long hash (unsigned long long h) {
+    h += seed + 0x9e3779b97f4a7c15ull;
+    h = (h ^ (h >> 30))*0xbf58476d1ce4e5b9ull;
+    h = (h ^ (h >> 27))*0x94d049bb133111ebull;
+    return h ^ (h >> 31);
   }
 
   static Parameter constant (double x) { return Parameter(x, x); }
 
+  // Interval [l, u] exactly as given, not perturbed.  For restoring
+  // saved inputs.
+  static Parameter bounds (double l, double u) { return Parameter(l, u); }
+
   Parameter (const Parameter &p) : l(p.l) {
     if (l != sentinel)
       u.r = p.u.r;
@@ -308,28 +590,30 @@ class Parameter {
     return *this;
   }
   
-  // Determine the sign of a parameter: -1 or 1.
-  // If fail==true, will return 0 on sign failure.
-  // Otherwise throws SignException.
+  // Determine the sign of a parameter: -1, 0 or 1.  0 means the value
+  // is exactly zero, or that the sign is not known at this precision.
+  // If fail==false, will return 0 on sign failure.
+  // Otherwise, inside a Predicate, sets context.failed and returns 0,
+  // and outside one throws SignException.
   int sign (bool fail = true) const {
     if (l != sentinel) {
       if (l > 0.0)
 	return 1;
       if (u.r < 0.0)
 	return -1;
+      // More bits cannot narrow [0, 0].
       if (fail)
-	throw signException;
+	signFailed(l == 0.0 && u.r == 0.0 ? exactPrecision : context.highPrecision);
       return 0;
     }
     int s = u.e->sign();
-    if (s)
+    if (s || u.e->x)
       return s;
     if (fail) {
-      highPrecision *= 2;
-      if (highPrecision <= maxPrecision)
-        throw signException;
-      else
-        throw precisionException;
+      unsigned int p = 2*context.highPrecision;
+      if (p > maxPrecision || (u.e->lb() == 0.0 && u.e->ub() == 0.0))
+        p = exactPrecision;
+      signFailed(p);
     }
     return 0;
   }
@@ -349,20 +633,20 @@ class Parameter {
   // Hence 2 * p does not perturb the 2.
   Parameter operator+ (const Parameter &b) const {
     if (l != sentinel && b.l != sentinel)
-      return Parameter(- (- l - b.l), u.r + b.u.r);
+      return Parameter(sumDown(l, b.l), sumUp(u.r, b.u.r));
     assert(l == sentinel && b.l == sentinel);
     return Parameter(u.e->plus(*b.u.e));
   }
 
   Parameter operator+ (double b) const {
     if (l != sentinel)
-      return Parameter(- (- l - b), u.r + b);
+      return Parameter(sumDown(l, b), sumUp(u.r, b));
     return Parameter(u.e->plus(b));
   }
   
   Parameter operator- (const Parameter &b) const {
     if (l != sentinel && b.l != sentinel)
-      return Parameter(- (b.u.r - l), u.r - b.l);
+      return Parameter(sumDown(l, - b.u.r), sumUp(u.r, - b.l));
     assert(l == sentinel && b.l == sentinel);
     return Parameter(u.e->minus(*b.u.e));
   }
@@ -377,57 +661,92 @@ class Parameter {
   
   Parameter operator* (const Parameter &b) const {
     if (l != sentinel && b.l != sentinel) {
-      Parameter s = u.r < 0.0 ? - *this : *this, t = u.r < 0.0 ? - b : b;
-      if (s.l > 0.0) {
-	double k = t.l > 0.0 ? - s.l : - s.u.r;
-	return Parameter(- (k*t.l), t.u.r > 0.0 ? s.u.r*t.u.r : s.l*t.u.r);
-      }
-      if (t.l > 0.0) {
-	double k = - s.l;
-	return Parameter(- (k*t.u.r), s.u.r*t.u.r);
-      }
-      if (t.u.r < 0.0) {
-	double k = - s.u.r;
-	return Parameter(- (k*t.l), s.l*t.l);
-      }
-      double k1 = - s.l, k2 = - s.u.r, cl1 = k1*t.u.r, cl2 = k2*t.l, 
-	cu1 = s.l*t.l, cu2 = s.u.r*t.u.r,
-	cl = cl1 < cl2 ? - cl2 : - cl1, cu = cu1 < cu2 ? cu2 : cu1;
-      return Parameter(cl, cu);
+      double pl, pu;
+      product(b, pl, pu);
+      return Parameter(pl, pu);
     }
     assert(l == sentinel && b.l == sentinel);
     return Parameter(u.e->times(*b.u.e));
   }
   
   Parameter operator* (double b) const {
-    if (l != sentinel) {
-      double k = - b;
-      return b > 0.0 ? Parameter(- (k*l), b*u.r) : Parameter(- (k*u.r), b*l);
-    }
+    if (l != sentinel)
+      return b > 0.0 ? Parameter(down(b*l), up(b*u.r)) : Parameter(down(b*u.r), up(b*l));
     return Parameter(u.e->times(b));
   }
 
+  // a*b - c*d and a*b + c*d, with both products formed branch-free on
+  // double intervals.
+  static Parameter diffProducts (const Parameter &a, const Parameter &b,
+                                 const Parameter &c, const Parameter &d) {
+    if (a.l != sentinel && b.l != sentinel && c.l != sentinel && d.l != sentinel) {
+      double pl, pu, ql, qu;
+      a.product(b, pl, pu);
+      c.product(d, ql, qu);
+      return Parameter(sumDown(pl, - qu), sumUp(pu, - ql));
+    }
+    Parameter s = a*b;
+    s -= c*d;
+    return s;
+  }
+
+  static Parameter sumProducts (const Parameter &a, const Parameter &b,
+                                const Parameter &c, const Parameter &d) {
+    if (a.l != sentinel && b.l != sentinel && c.l != sentinel && d.l != sentinel) {
+      double pl, pu, ql, qu;
+      a.product(b, pl, pu);
+      c.product(d, ql, qu);
+      return Parameter(sumDown(pl, ql), sumUp(pu, qu));
+    }
+    Parameter s = a*b;
+    s += c*d;
+    return s;
+  }
+
   Parameter operator/ (const Parameter &b) const {
     int bs = b.sign();
     if (l != sentinel && b.l != sentinel) {
       if (bs == 1) {
 	if (l >= 0.0)
-	  return Parameter(- ((- l)/b.u.r), u.r/b.l);
+	  return Parameter(down(l/b.u.r), up(u.r/b.l));
 	if (u.r <= 0.0)
-	  return Parameter(- ((- l)/b.l), u.r/b.u.r);
-	return Parameter(- ((- l)/b.u.r), u.r/b.u.r);
+	  return Parameter(down(l/b.l), up(u.r/b.u.r));
+	return Parameter(down(l/b.l), up(u.r/b.l));
       }
       if (l >= 0.0)
-	return Parameter(- ((- u.r)/b.u.r), l/b.l);
+	return Parameter(down(u.r/b.u.r), up(l/b.l));
       if (u.r <= 0.0)
-	return Parameter(- ((- u.r)/b.l), l/b.u.r);
-      return Parameter(- ((- u.r)/b.l), l/b.l);
+	return Parameter(down(u.r/b.l), up(l/b.u.r));
+      return Parameter(down(u.r/b.u.r), up(l/b.u.r));
     }
     assert(l == sentinel && b.l == sentinel);
     return Parameter(u.e->divide(*b.u.e));
   }
 
-  Parameter operator/ (double b) const { return *this*(1.0/b); }
+  Parameter operator/ (double b) const {
+    if (l == sentinel && u.e->x)
+      return Parameter(u.e->divide(b));
+    return *this*(1.0/b);
+  }
+
+  // In-place + and -.  Reuse the high-precision storage if unshared.
+  Parameter & operator+= (const Parameter &b) {
+    if (l == sentinel && u.e->refCnt == 1) {
+      assert(b.l == sentinel);
+      u.e->add(*b.u.e);
+      return *this;
+    }
+    return *this = *this + b;
+  }
+
+  Parameter & operator-= (const Parameter &b) {
+    if (l == sentinel && u.e->refCnt == 1) {
+      assert(b.l == sentinel);
+      u.e->sub(*b.u.e);
+      return *this;
+    }
+    return *this = *this - b;
+  }
     
   bool operator< (const Parameter &b) const { return (b - *this).sign() == 1; }
   bool operator< (double b) const { return (*this - b).sign() == -1; }
@@ -442,18 +761,70 @@ class Parameter {
 
  private:
   static const double sentinel;
-  static unsigned int highPrecision;
-  static bool enabled;
-  static bool quadDouble;
-  static unsigned int controlWord;
 
   Parameter (double il, double iu) : l(il) { u.r = iu; }    
 
   Parameter (EInt *e) : l(sentinel) { u.e = e; }
 
+  // Outward rounding of a round-to-nearest result x: down(x) <= pred(x)
+  // and up(x) >= succ(x), after Rump, Zimmermann, Boldo and Melquiond,
+  // "Computing predecessor and successor in rounding to nearest".
+  // Widens by at most two ulps, or by DBL_MIN below widenFloor.
+  static double down (double x) {
+    return x - std::max(fabs(x), widenFloor)*(0.5*DBL_EPSILON*(1.0 + DBL_EPSILON));
+  }
+
+  static double up (double x) {
+    return x + std::max(fabs(x), widenFloor)*(0.5*DBL_EPSILON*(1.0 + DBL_EPSILON));
+  }
+
+  // a + b rounded down and up.  The rounding error of the sum decides
+  // the direction, so an exact sum is not widened.
+  static double sumDown (double a, double b) {
+    double s = a + b, bv = s - a, e = (a - (s - bv)) + (b - bv);
+    return e < 0.0 ? down(s) : s;
+  }
+
+  static double sumUp (double a, double b) {
+    double s = a + b, bv = s - a, e = (a - (s - bv)) + (b - bv);
+    return e > 0.0 ? up(s) : s;
+  }
+
+  // Bounds of the product of two double intervals: the min and max of
+  // the four endpoint products, without sign tests.
+  void product (const Parameter &b, double &pl, double &pu) const {
+    double p0 = l*b.l, p1 = l*b.u.r, p2 = u.r*b.l, p3 = u.r*b.u.r;
+    pl = down(std::min(std::min(p0, p1), std::min(p2, p3)));
+    pu = up(std::max(std::max(p0, p1), std::max(p2, p3)));
+  }
+
+  static unsigned long long bits (double x) {
+    unsigned long long b;
+    memcpy(&b, &x, sizeof(b));
+    return b;
+  }
+
+  // x moved by up to delta*(1 + |x|), by a fraction of it taken from
+  // the top 53 bits of h.
+  static double perturb (double x, unsigned long long h) {
+    double r = (h >> 11)*(2.0/9007199254740992.0) - 1.0;
+    return x + delta*(1.0 + fabs(x))*r;
+  }
+
+  // Inside a Predicate, the next escalation is to precision p.  The
+  // precision is left alone when throwing, as no escalation follows.
+  static void signFailed (unsigned int p) {
+    if (!context.predicates)
+      throw signException;
+    context.highPrecision = p;
+    context.failed = true;
+  }
+
   Parameter lbP () const {
     if (l != sentinel)
       return Parameter(l, l);
+    if (u.e->x)
+      return *this;
     if (u.e->lm == 0)
       return Parameter(new EInt(u.e->lq, u.e->lq));
     else
@@ -463,6 +834,8 @@ class Parameter {
   Parameter ubP () const {
     if (l != sentinel)
       return Parameter(u.r, u.r);
+    if (u.e->x)
+      return *this;
     if (u.e->lm == 0)
       return Parameter(new EInt(u.e->uq, u.e->uq));
     else
@@ -470,45 +843,61 @@ class Parameter {
   }
 
   unsigned int precision () const {
-    return l != sentinel ? 53u : (!u.e->lm ? 212u : u.e->lm->p);
+    if (l != sentinel)
+      return 53u;
+    return u.e->x ? exactPrecision : !u.e->lm ? 212u : u.e->lm->p;
   }
 
-  bool increased () const { return precision() == highPrecision; }
+  bool increased () const { return precision() == context.highPrecision; }
   bool decreased () const { return precision() == 53u; }
 
  public:
+  // At exactPrecision, an input is taken to be exactly its lower
+  // bound, as for a perturbed input.  A derived value is recalculated
+  // from its inputs.
   void increasePrecision () {
-    if (l == sentinel && 
-	(highPrecision == 212u || (u.e->lm && u.e->lm->p == highPrecision)))
+    if (l == sentinel && precision() == context.highPrecision)
       return;
     double il = lb(), iu = ub();
-    disable();
     if (l == sentinel)
       u.e->decRef();
     l = sentinel;
-    if (highPrecision == 212u) {
-      if (!quadDouble) {
-        //fpu_fix_start(&controlWord);
-        quadDouble = true;
+    if (context.highPrecision == exactPrecision) {
+      if (context.quadDouble) {
+        //fpu_fix_end(&context.controlWord);
+        context.quadDouble = false;
+      }
+      u.e = new EInt(new Rational(il));
+    }
+    else if (context.highPrecision == 212u) {
+      if (!context.quadDouble) {
+        //fpu_fix_start(&context.controlWord);
+        context.quadDouble = true;
       }
       u.e = new EInt(QValue(il), QValue(iu));
     }
     else {
-      if (quadDouble) {
-        //fpu_fix_end(&controlWord);
-        quadDouble = false;
+      if (context.quadDouble) {
+        //fpu_fix_end(&context.controlWord);
+        context.quadDouble = false;
       }
-      u.e = new EInt(MValue(il, highPrecision), MValue(iu, highPrecision));
+      u.e = new EInt(MValue(il, context.highPrecision), MValue(iu, context.highPrecision));
     }
   }
 
+  // Set to a value calculated earlier at the current high precision.
+  void restorePrecision (const Parameter &p) {
+    assert(p.l == sentinel && p.precision() == context.highPrecision);
+    context.quadDouble = context.highPrecision == 212u;
+    *this = p;
+  }
+
   void decreasePrecision () {
     if (l == sentinel) {
-      Parameter::highPrecision = 212u;
-      enable();
-      if (quadDouble) {
-        //fpu_fix_end(&controlWord);
-        quadDouble = false;
+      context.highPrecision = 212u;
+      if (context.quadDouble) {
+        //fpu_fix_end(&context.controlWord);
+        context.quadDouble = false;
       }
       double dl = lb(), du = ub();
       u.e->decRef();
@@ -0,0 +1,100 @@
+#ifndef ARENA
+#define ARENA
+
+#include <stddef.h>
+#include <vector>
+#include "object.h"
+
+///////////////////////////////////////////////////////////////////////////////////
+// Region allocator for temporary geometry
+//
+// allocate() bumps a pointer through a list of blocks.  rewind() frees
+// everything allocated after a mark at once, and keeps the blocks for
+// the next use, so a long run of queries does not grow memory.
+// Destructors are not run.  That is safe for Objects whose Parameters
+// are back at double precision, as they are between predicates.  An
+// Arena is rewound by the thread that allocates from it, and only that
+// thread's memos of the freed Objects are dropped (see
+// Object::forgetMemos).
+
+class Arena {
+ public:
+  struct Mark {
+    size_t block;
+    char *next;
+    // memoWrites of the thread when the mark was taken.
+    unsigned long long memoWrites;
+  };
+
+  Arena () : block(0), next(0), end(0) {}
+  ~Arena ();
+
+  void * allocate (size_t size) {
+    size = (size + alignment - 1) & ~(alignment - 1);
+    if (size > (size_t) (end - next))
+      nextBlock(size);
+    void *p = next;
+    next += size;
+    return p;
+  }
+
+  Mark mark () const { Mark m = { block, next, acp::memoWrites }; return m; }
+  void rewind (const Mark &m);
+  void reset () { Mark m = { 0, 0, 0 }; rewind(m); }
+
+  // Where splitLineSegment puts its points and segments in the calling
+  // thread, or 0 for the heap.  Set by ArenaScope.
+  static ACP_THREAD Arena *active;
+
+  // The calling thread's arena for the temporaries of queries.  Freed
+  // by releaseThreadMemory.
+  static Arena & query ();
+
+ private:
+  Arena (const Arena &);
+  void operator= (const Arena &);
+  void nextBlock (size_t size);
+
+  static const size_t alignment = 16, blockSize = 1 << 16;
+
+  // blocks[0, block) are in use, the last one up to next.
+  std::vector<char *> blocks;
+  std::vector<size_t> sizes;
+  size_t block;
+  char *next, *end;
+};
+
+// Makes arena the active one until the end of the scope.  On the way
+// out the outer one is restored and, unless keep is set, everything
+// allocated in the scope is freed.
+class ArenaScope {
+ public:
+  ArenaScope (Arena &arena, bool keep = false)
+    : arena(arena), outer(Arena::active), start(arena.mark()), keep(keep) {
+    Arena::active = &arena;
+  }
+  ~ArenaScope () {
+    Arena::active = outer;
+    if (!keep)
+      arena.rewind(start);
+  }
+ private:
+  Arena &arena;
+  Arena *outer;
+  Arena::Mark start;
+  bool keep;
+};
+
+// new (arena) T(...) allocates from arena, or from the heap if it is 0.
+inline void * operator new (size_t size, Arena *arena)
+{
+  return arena ? arena->allocate(size) : ::operator new(size);
+}
+
+inline void operator delete (void *p, Arena *arena)
+{
+  if (arena == 0)
+    ::operator delete(p);
+}
+
+#endif
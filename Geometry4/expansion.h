@@ -0,0 +1,86 @@
+#ifndef EXPANSION_H
+#define EXPANSION_H
+
+#include "acp.h"
+
+namespace acp {
+
+// Exact floating-point expansion arithmetic, after Shewchuk, "Adaptive
+// Precision Floating-Point Arithmetic and Fast Robust Geometric
+// Predicates".  An expansion is a sum of nonoverlapping doubles stored
+// in order of increasing magnitude.  The error-free transformations
+// below are exact in round-to-nearest mode, which ACP runs in.
+
+// a + b = x + err exactly.
+inline double twoSum (double a, double b, double &err)
+{
+  double x = a + b, bv = x - a, av = x - bv;
+  err = (a - av) + (b - bv);
+  return x;
+}
+
+// a - b = x + err exactly.
+inline double twoDiff (double a, double b, double &err)
+{
+  double x = a - b, bv = a - x, av = x + bv;
+  err = (a - av) + (bv - b);
+  return x;
+}
+
+// Veltkamp split of a into two 26-bit halves.
+inline void split (double a, double &hi, double &lo)
+{
+  double c = 134217729.0*a, big = c - a;
+  hi = c - big;
+  lo = a - hi;
+}
+
+// a * b = x + err exactly.
+inline double twoProduct (double a, double b, double &err)
+{
+  double x = a*b, ahi, alo, bhi, blo;
+  split(a, ahi, alo);
+  split(b, bhi, blo);
+  err = alo*blo - (((x - ahi*bhi) - alo*bhi) - ahi*blo);
+  return x;
+}
+
+// h = e + b with zero components removed.  Returns the length of h,
+// at most m + 1.  h may not alias e.
+inline int growExpansion (int m, const double *e, double b, double *h)
+{
+  int n = 0;
+  double q = b;
+  for (int i = 0; i < m; ++i) {
+    double err;
+    q = twoSum(q, e[i], err);
+    if (err != 0.0)
+      h[n++] = err;
+  }
+  if (q != 0.0 || n == 0)
+    h[n++] = q;
+  return n;
+}
+
+// Exact sign of the sum of n <= maxSumTerms doubles.
+static const int maxSumTerms = 32;
+
+inline int sumSign (int n, const double *t)
+{
+  double e[maxSumTerms + 1], h[maxSumTerms + 1];
+  int m = 0;
+  assert(n <= maxSumTerms);
+  for (int i = 0; i < n; ++i) {
+    if (t[i] == 0.0)
+      continue;
+    m = growExpansion(m, e, t[i], h);
+    std::copy(h, h + m, e);
+  }
+  if (m == 0)
+    return 0;
+  return e[m - 1] > 0.0 ? 1 : e[m - 1] < 0.0 ? -1 : 0;
+}
+
+}
+
+#endif
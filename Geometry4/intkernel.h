@@ -0,0 +1,138 @@
+#ifndef INTKERNEL
+#define INTKERNEL
+
+#include <vector>
+#include <assert.h>
+
+using namespace std;
+
+///////////////////////////////////////////////////////////////////////////////////
+// Exact integer kernel
+//
+// For line segments whose endpoints are on the integer grid, with
+// |coordinate| < gridLimit.  Orientations are exact in 64 bits:
+// differences take 30 bits, their products 60.  There is no
+// perturbation, no interval arithmetic and no escalation.  Degenerate
+// orientations are 0, so segments that touch intersect, as do collinear
+// segments that overlap.
+//
+// Segments are only split at integer lines x = c or y = c, and a split
+// point is computed from the input segment, not from the piece being
+// split.  Its other coordinate is a rational n/d with |n| < 2^61 and
+// 0 < d < 2^30, however many times the segment has been split.
+
+static const long long gridLimit = 1LL << 29;
+
+// n/d, d > 0.
+struct GridValue {
+  GridValue () : n(0), d(1) {}
+  GridValue (long long n) : n(n), d(1) {}
+  GridValue (long long n, long long d) : n(d < 0 ? - n : n), d(d < 0 ? - d : d) {}
+
+  // Sign of n/d - c.
+  int compare (long long c) const {
+    long long t = n - c*d;
+    return t > 0 ? 1 : t < 0 ? -1 : 0;
+  }
+
+  // Largest integer not above n/d.
+  long long floor () const { return n >= 0 ? n/d : - ((- n + d - 1)/d); }
+
+  // Sign of n/d - v.  The integer parts are compared first, so that
+  // the cross products of the remainders fit in 60 bits.
+  int compare (const GridValue &v) const {
+    long long f = floor(), g = v.floor();
+    if (f != g)
+      return f > g ? 1 : -1;
+    long long t = (n - f*d)*v.d - (v.n - g*v.d)*d;
+    return t > 0 ? 1 : t < 0 ? -1 : 0;
+  }
+
+  long long n, d;
+};
+
+// A piece p[0] - p[1] of the input segment a - b.  p[i][0] is x and
+// p[i][1] is y.
+struct GridSegment {
+  GridSegment () {}
+  // The coordinates must be within gridLimit, or the orientations and
+  // split points overflow.
+  GridSegment (int ax, int ay, int bx, int by) {
+    assert(inRange(ax) && inRange(ay) && inRange(bx) && inRange(by));
+    a[0] = ax; a[1] = ay; b[0] = bx; b[1] = by;
+    p[0][0] = ax; p[0][1] = ay; p[1][0] = bx; p[1][1] = by;
+  }
+
+  static bool inRange (long long c) { return - gridLimit < c && c < gridLimit; }
+
+  int a[2], b[2];
+  GridValue p[2][2];
+};
+
+typedef vector<GridSegment> GridSegments;
+
+// Sign of (c - b) x (a - b), as LeftTurn(a, b, c).
+inline int gridLeftTurn (long long ax, long long ay, long long bx, long long by,
+                         long long cx, long long cy)
+{
+  long long t = (cx - bx)*(ay - by) - (cy - by)*(ax - bx);
+  return t > 0 ? 1 : t < 0 ? -1 : 0;
+}
+
+// The ranges of coordinate axis of the input segments of s and t
+// overlap.  Collinear segments intersect if they do on both axes.
+inline bool gridOverlap (const GridSegment &s, const GridSegment &t, int axis)
+{
+  int s0 = s.a[axis], s1 = s.b[axis], t0 = t.a[axis], t1 = t.b[axis];
+  if (s0 > s1)
+    swap(s0, s1);
+  if (t0 > t1)
+    swap(t0, t1);
+  return s0 <= t1 && t0 <= s1;
+}
+
+// As LineSegment::intersects, on the input segments of the pieces.  Two
+// pieces of different input segments may be reported as intersecting
+// where their input segments do, outside the pieces, which is what a
+// query for any intersection wants.
+inline bool gridIntersects (const GridSegment &s, const GridSegment &t)
+{
+  int sa = gridLeftTurn(s.a[0], s.a[1], t.a[0], t.a[1], t.b[0], t.b[1]);
+  int sb = gridLeftTurn(s.b[0], s.b[1], t.a[0], t.a[1], t.b[0], t.b[1]);
+  int ta = gridLeftTurn(t.a[0], t.a[1], s.a[0], s.a[1], s.b[0], s.b[1]);
+  int tb = gridLeftTurn(t.b[0], t.b[1], s.a[0], s.a[1], s.b[0], s.b[1]);
+  // A point t makes sa and sb 0 wherever s is, so the segments are
+  // only collinear if t is also on the line of s.
+  if (sa == 0 && sb == 0 && ta == 0 && tb == 0)
+    return gridOverlap(s, t, 0) && gridOverlap(s, t, 1);
+  // An endpoint on the other segment's line gives a 0, which differs
+  // from the sign of the other endpoint.
+  return sa != sb && ta != tb;
+}
+
+// 1 if coordinate axis (0 for x, 1 for y) is below c all along s, -1
+// if it is above c, 0 if s touches or crosses the line there.
+inline int gridClassify (const GridSegment &s, int axis, long long c)
+{
+  int c0 = s.p[0][axis].compare(c), c1 = s.p[1][axis].compare(c);
+  if (c0 < 0 && c1 < 0)
+    return 1;
+  if (c0 > 0 && c1 > 0)
+    return -1;
+  return 0;
+}
+
+// Integer split line through the first endpoint of s, rounded down.
+inline long long gridSplitValue (const GridSegment &s, int axis)
+{
+  return s.p[0][axis].floor();
+}
+
+// Cut s at the line where coordinate axis is c into the part below c
+// and the part above it.  Both start at an endpoint of s.  A segment on the
+// line goes whole to both sides.
+void gridSplit (const GridSegment &s, int axis, long long c, GridSegment &below, GridSegment &above);
+
+bool naiveIntersects (GridSegments &segments, const GridSegment &l);
+
+#endif
@@ -7,6 +7,7 @@
 #include <iomanip>
 #include "point.h"
 #include "object.h"
+#include "arena.h"
 
 using namespace std;
 using namespace acp;
@@ -16,49 +17,377 @@ using namespace acp;
 
 class LineSegment {
  public:
-  LineSegment () : p0(0), p1(0) {}
-  LineSegment (Point *p0, Point *p1) : p0(p0), p1(p1) {}
+  LineSegment () : p0(0), p1(0), whole(0) {}
+  LineSegment (Point *p0, Point *p1, LineSegment *whole = 0) : p0(p0), p1(p1), whole(whole) {}
+  // A piece is tested as the segment it was split from, so a query for
+  // any intersection gets the same answer with fewer derived points.
+  // Segments that share an endpoint object, as neighbors in a polyline
+  // do, touch but do not intersect.
   bool intersects (LineSegment *l);
+  bool shares (LineSegment *l) const {
+    return p0 == l->p0 || p0 == l->p1 || p1 == l->p0 || p1 == l->p1;
+  }
+  LineSegment * original () { return whole ? whole : this; }
 
   Point *p0;
   Point *p1;
+  // The unsplit segment this is a piece of, or 0.
+  LineSegment *whole;
 };
 
 typedef vector<LineSegment *> LineSegments;
 
-class KdTreeNode {
+// A line segment between points p0 and p1 of a PointStore.
+struct IndexedSegment {
+  IndexedSegment () : p0(0), p1(0) {}
+  IndexedSegment (int p0, int p1) : p0(p0), p1(p1) {}
+  bool shares (const IndexedSegment &s) const {
+    return p0 == s.p0 || p0 == s.p1 || p1 == s.p0 || p1 == s.p1;
+  }
+  int p0, p1;
+};
+
+typedef vector<IndexedSegment> IndexedSegments;
+
+// Line segments with their endpoint intervals copied out in
+// structure-of-arrays form, for testing one segment against all of them
+// at once.  The four LeftTurn tests of LineSegment::intersects are
+// bounded for a block of segments by diffProductsBatch; only the
+// segments that this double-interval filter cannot decide go through
+// the exact predicates.
+class SegmentBatch {
+ public:
+  SegmentBatch () : store(0) {}
+  SegmentBatch (LineSegments &lineSegments);
+  void push_back (LineSegment *l);
+  // A segment of store, which must be the same for all of them.  No
+  // LineSegment is made for it, and the exact test between two store
+  // segments works on their coordinates.
+  void push_back (PointStore &store, const IndexedSegment &s);
+  int size () const { return lineSegments.size(); }
+  // Filter segments [begin, end) against q0 q1.  Returns true if one of
+  // them certainly intersects it, else appends the indices of the
+  // undecided ones to undecided.
+  bool filter (const PV2 &q0, const PV2 &q1, int begin, int end, vector<int> &undecided);
+  bool intersects (LineSegment *l);
+  bool intersects (PointStore &store, const IndexedSegment &s);
+
+  // Null for the segments of the store.
+  LineSegments lineSegments;
+
+ private:
+  void push_back (LineSegment *l, IndexedSegment s, const PV2 &p0, const PV2 &p1);
+  LineSegment segment (int i) {
+    return LineSegment(store->object(indices[i].p0), store->object(indices[i].p1));
+  }
+
+  PointStore *store;
+  IndexedSegments indices;
+  // Endpoints, p1 - p0, and p1 - p0 cross p0, as lower and upper bounds.
+  vector<double> x0l, x0u, y0l, y0u, x1l, x1u, y1l, y1u;
+  vector<double> uxl, uxu, uyl, uyu, cl, cu;
+};
+
+// Polylines as runs of vertex indices into a PointStore.  Chain c has
+// vertices vertices[starts[c]] up to the start of chain c + 1, and its
+// segments join consecutive vertices.  A vertex is stored once however
+// many segments meet at it, and they all get the same InputPoint, so
+// the pointer tests of LineSegment and of the kd-tree apply between
+// neighbors.
+class Polylines {
  public:
-  KdTreeNode (int splitType) : lineSegment(0), splitType(splitType), splitAt(0), left(0), right(0) {}
-  KdTreeNode (LineSegment *l, int splitType) : lineSegment(l), splitType(splitType), splitAt(l->p0), left(0), right(0) {}
-  void insert (LineSegment *l);
-  void insertRight (LineSegment *l);
-  void insertLeft (LineSegment *l);
+  Polylines () {}
+  // Start a chain at a new point or at vertex v.
+  void begin (double x, double y) { begin(store.add(x, y)); }
+  void begin (int v) { starts.push_back(vertices.size()); vertices.push_back(v); }
+  // Extend the current chain to a new point or to vertex v.
+  void add (double x, double y) { add(store.add(x, y)); }
+  void add (int v) { vertices.push_back(v); }
+  // Join the current chain back to its first vertex.
+  void close () { add(vertices[starts.back()]); }
+  int chains () const { return starts.size(); }
+  int end (int c) const { return c + 1 < chains() ? starts[c + 1] : vertices.size(); }
+  // Number of segments.
+  int size () const { return vertices.size() - chains(); }
+  // Append a LineSegment for each segment.
+  void lineSegments (LineSegments &out);
+  // l crosses a segment.  A chain is tested as a run: each vertex is
+  // compared against the line of l once for both segments at it, and
+  // only segments whose ends are on opposite sides go further.
+  // Segments that touch l, as at a shared vertex, do not count.
   bool intersects (LineSegment *l);
+
+  PointStore store;
+  vector<int> vertices, starts;
+
+ private:
+  Polylines (const Polylines &);
+  void operator= (const Polylines &);
+};
+
+// The pieces and the split point come from Arena::active, if set.
+void splitLineSegment (LineSegment *l, Point *splitAt, int splitType, LineSegment **l0, LineSegment **l1);
+
+// The unsplit segments that the current query of this thread has been
+// tested against, so that their other pieces are skipped.  Direct
+// mapped, like the memo table: a collision only costs a repeated test.
+// An entry is current if it has the stamp of the query, so begin() is
+// O(1).  Freed by releaseThreadMemory.
+class Mailbox {
+ public:
+  static void begin () {
+    if (current == 0)
+      current = new Mailbox;
+    if (++current->stamp == 0) {
+      fill(current->segments, current->segments + size, (LineSegment *) 0);
+      current->stamp = 1;
+    }
+  }
+
+  // Whether s has been tested in this query.  If not, it is marked.
+  static bool tested (LineSegment *s) {
+    size_t h = (size_t) s;
+    h = ((h >> 4) ^ (h >> 13)) & (size - 1);
+    if (current->segments[h] == s && current->stamps[h] == current->stamp)
+      return true;
+    current->segments[h] = s;
+    current->stamps[h] = current->stamp;
+    return false;
+  }
+
+  static void release () {
+    delete current;
+    current = 0;
+  }
+
+ private:
+  enum { size = 1024 };
+  Mailbox () : stamp(0) { fill(segments, segments + size, (LineSegment *) 0); }
+
+  static ACP_THREAD Mailbox *current;
+  LineSegment *segments[size];
+  unsigned int stamps[size];
+  unsigned int stamp;
+};
+
+///////////////////////////////////////////////////////////////////////////////////
+// Geometry kernels
+//
+// KdTreeT is templated on a kernel K that supplies
+//   K::Segment  the handle of a segment stored in the tree
+//   K::Split    where a node splits
+//   K::splitAt(l, splitType)  split through the first endpoint of l
+//   K::classify(l, s, splitType)  1 if l is below s, -1 if above, 0 if
+//     it crosses or touches it
+//   K::split(l, s, splitType, &l0, &l1)  cut l at s, l0 below; the
+//     pieces come from Arena::active
+//   K::beginQuery()  called at the start of each query
+//   K::intersects(s, l)
+//   K::less(l, m, axis)  order by first endpoint, for the builders
+//   K::coordinate(s, axis), K::coordinate(l, end, axis)  approximate
+//     values, for cost estimates and debug output
+// all static and inline, so that a tree on a non-ACP kernel makes no
+// virtual Predicate calls.  The ACP kernel is below; the integer and
+// double ones are in kernel.h.
+
+// Exact predicates on perturbed ACP Parameters.
+struct AcpKernel {
+  typedef LineSegment *Segment;
+  typedef Point *Split;
+
+  static Split splitAt (Segment l, int splitType) { return l->p0; }
+
+  static int classify (Segment l, Split s, int splitType) {
+    // A segment with an endpoint on the split line, as a neighbor of
+    // the node's segment in a polyline or a piece cut at this line
+    // higher up, is on the side of its other endpoint.
+    Point *r = s->source(splitType);
+    if (l->p0->source(splitType) == r)
+      return side(l->p1, s, splitType);
+    if (l->p1->source(splitType) == r)
+      return side(l->p0, s, splitType);
+    if (splitType == 0) {
+      if (XOrder(l->p0, s) == 1 && XOrder(l->p1, s) == 1)
+        return 1;
+      if (XOrder(s, l->p0) == 1 && XOrder(s, l->p1) == 1)
+        return -1;
+    } else {
+      if (YOrder(l->p0, s) == 1 && YOrder(l->p1, s) == 1)
+        return 1;
+      if (YOrder(s, l->p0) == 1 && YOrder(s, l->p1) == 1)
+        return -1;
+    }
+    return 0;
+  }
+
+  // 1 if p is below s, else -1.  p is not s.
+  static int side (Point *p, Split s, int splitType) {
+    return (splitType == 0 ? XOrder(p, s) : YOrder(p, s)) == 1 ? 1 : -1;
+  }
+
+  static void split (Segment l, Split s, int splitType, Segment *l0, Segment *l1) {
+    splitLineSegment(l, s, splitType, l0, l1);
+  }
+
+  static void beginQuery () { Mailbox::begin(); }
+
+  // Pieces of one segment in several nodes are tested once per query.
+  static bool intersects (Segment s, Segment l) {
+    return !Mailbox::tested(s->original()) && s->intersects(l);
+  }
+
+  static bool less (Segment l, Segment m, int axis) {
+    return l != m && (axis == 0 ? XOrder(l->p0, m->p0) : YOrder(l->p0, m->p0)) == 1;
+  }
+
+  static double coordinate (Split s, int axis) {
+    PV2 p = s->getP();
+    return (axis == 0 ? p.getX() : p.getY()).mid();
+  }
+
+  static double coordinate (Segment l, int end, int axis) {
+    return coordinate(end ? l->p1 : l->p0, axis);
+  }
+};
+
+template <class K>
+class KdTreeNodeT {
+ public:
+  typedef typename K::Segment Segment;
+  typedef typename K::Split Split;
+
+  KdTreeNodeT (int splitType) : lineSegment(0), splitType(splitType), splitAt(), left(0), right(0) {}
+  KdTreeNodeT (Segment l, int splitType) : lineSegment(l), splitType(splitType), splitAt(K::splitAt(l, splitType)), left(0), right(0) {}
+  void insert (Segment l);
+  void insertRight (Segment l);
+  void insertLeft (Segment l);
+  int classify (Segment l) { return K::classify(l, splitAt, splitType); }
+  bool intersects (Segment l);
   void debug (int level);
   int depth ();
 
   int splitType;	// split by a plane that is perpendicular to X axis (0) or Y axis (1).
-  Point *splitAt;
-  LineSegment *lineSegment;
-  KdTreeNode *left;
-  KdTreeNode *right;
+  Split splitAt;
+  Segment lineSegment;
+  KdTreeNodeT *left;
+  KdTreeNodeT *right;
 };
 
-class KdTree {
+template <class K>
+class KdTreeT {
  public:
-  KdTree () : root(0) {}
-  void insert (LineSegment *l);
-  bool intersects (LineSegment *l);
+  typedef typename K::Segment Segment;
+  typedef typename K::Split Split;
+  typedef vector<Segment> Segments;
+  typedef typename Segments::iterator iterator;
+  typedef KdTreeNodeT<K> Node;
+
+  // Order in which a batch of queries is run.
+  enum Order { inputOrder, mortonOrder, hilbertOrder };
+
+  // Statistics of the last build().
+  struct Stats {
+    Stats () : depthFallbacks(0), imbalanceFallbacks(0) {}
+    // Subtrees ordered by median splits because they were below
+    // maxCostDepth, or because their cheapest split was too unbalanced.
+    int depthFallbacks, imbalanceFallbacks;
+  };
+
+  KdTreeT () : root(0), maxCostDepth(0), maxImbalance(0.95) {}
+  void insert (Segment l);
+  bool intersects (Segment l);
+  // results[i] = intersects(queries[i]).  Running the queries in the
+  // order of their midpoints along a space-filling curve keeps
+  // consecutive ones in the same part of the tree, and so in cache.
+  void intersects (Segments &queries, vector<bool> &results, Order order = inputOrder);
   void debug ();
-  void build (LineSegments &lineSegments);
-  void medianBuild (LineSegments &lineSegments);
-  void naiveBuild (LineSegments &lineSegments);
-  void orderLineSegmentsByCost (LineSegments &lineSegments, LineSegments::iterator begin, LineSegments::iterator end, int orderType, int depth, map<int, LineSegments> &orderedLineSegments);
-  void orderLineSegmentsByMedian (LineSegments &lineSegments, LineSegments::iterator begin, LineSegments::iterator end, int orderType, int depth, map<int, LineSegments> &orderedLineSegments);
-  double computeCost (LineSegments &lineSegments, LineSegments::iterator begin, LineSegments::iterator end, Point* p, int splitType);
+  // Cost-based build.  The cheapest split can be very unbalanced on
+  // clustered input, so a subtree at depth maxCostDepth, or one whose
+  // cheapest split puts more than maxImbalance of its segments on one
+  // side, is ordered by median splits instead.  That keeps the depth of
+  // the ordering within maxCostDepth + log2 n.
+  void build (Segments &lineSegments);
+  void medianBuild (Segments &lineSegments);
+  void naiveBuild (Segments &lineSegments);
+  // Top down from one radix sort of the Morton codes of the midpoints,
+  // with no sort per level; see mortonNode.  The nodes are made in
+  // place rather than inserted from the root, so a level costs one
+  // classification per segment or piece in it.  The tree must be empty.
+  void mortonBuild (Segments &lineSegments);
+  Node * mortonNode (Segments &lineSegments, vector<unsigned int> &keys, int splitType);
+  void orderLineSegmentsByCost (Segments &lineSegments, iterator begin, iterator end, int orderType, int depth, int maxDepth, map<int, Segments> &orderedLineSegments);
+  void orderLineSegmentsByMedian (Segments &lineSegments, iterator begin, iterator end, int orderType, int depth, map<int, Segments> &orderedLineSegments);
+  double computeCost (Segments &lineSegments, iterator begin, iterator end, Segment candidate, int splitType);
   int depth ();
+  // ACP kernel only; see kdtreeio.C.  load replaces the tree, whose
+  // nodes and pieces are freed.  A file that cannot be opened or is not
+  // an index leaves it as it was; a malformed one leaves it empty.
+  bool save (const char *filename);
+  bool load (const char *filename);
 
-  KdTreeNode *root;
+  Node *root;
+  // Segments and points split off while inserting.
+  Arena arena;
+  // 0 for 8 + 2 log2 n.
+  int maxCostDepth;
+  double maxImbalance;
+  Stats stats;
+};
+
+// K::less as a comparison object.
+template <class K>
+class LineOrder {
+ public:
+  LineOrder (int axis) : axis(axis) {}
+  bool operator() (typename K::Segment l, typename K::Segment m) const { return K::less(l, m, axis); }
+  int axis;
+};
+
+typedef KdTreeNodeT<AcpKernel> KdTreeNode;
+typedef KdTreeT<AcpKernel> KdTree;
+
+template <> bool KdTree::save (const char *filename);
+template <> bool KdTree::load (const char *filename);
+
+// A KdTree packed for queries into an array of 12-byte nodes in
+// preorder, the left child of a node next to it.  A node keeps its split
+// coordinate as floats lo <= s <= hi, so that a query piece whose
+// interval bounds are clear of [lo, hi] is sent down one side without
+// touching the split Point; only pieces in that band are classified
+// exactly by AcpKernel::classify.  The split points and segments are in
+// parallel arrays, read only in the band and for the intersection tests.
+// It refers to the tree's segments and points, so the tree must outlive
+// it; it does not see later insertions.  The arrays are on huge pages if
+// Storage::hugePages is set when it is packed.
+class PackedKdTree {
+ public:
+  PackedKdTree () : prefetch(false) {}
+  PackedKdTree (KdTree &tree) : prefetch(false) { pack(tree); }
+  void pack (KdTree &tree);
+  bool intersects (LineSegment *l);
+  int size () const { return nodes.size(); }
+
+  // Prefetch the children of a node, and their segments, before testing
+  // its segment, for trees too large for the cache.
+  bool prefetch;
+
+ private:
+  struct Node {
+    float lo, hi;
+    // Bit 0 the split type, bit 1 set if the left child is the next
+    // node, the rest the index of the right child or 0.
+    unsigned int links;
+  };
+
+  int pack (KdTreeNode *node);
+  bool intersects (int i, LineSegment *l, const double *bounds);
+  int classify (int i, LineSegment *l, const double *bounds);
+  // lb and ub of the x and y of the endpoints of l.
+  static void getBounds (LineSegment *l, double *bounds);
+
+  vector<Node, HugePageAllocator<Node> > nodes;
+  vector<Point *, HugePageAllocator<Point *> > splits;
+  vector<LineSegment *, HugePageAllocator<LineSegment *> > segments;
 };
 
 class LineXOrder {
@@ -76,8 +405,7 @@ class LineYOrder {
 };
 
 bool naiveIntersects (LineSegments &lineSegments, LineSegment &l);
-
-void splitLineSegment (LineSegment *l, Point *splitAt, int splitType, LineSegment **l0, LineSegment **l1);
+bool naiveIntersects (SegmentBatch &batch, LineSegment &l);
 
 void pl(LineSegment *l);
 
@@ -0,0 +1,168 @@
+#ifndef KDTREE3
+#define KDTREE3
+
+#include <vector>
+#include "object.h"
+#include "arena.h"
+
+using namespace std;
+using namespace acp;
+
+///////////////////////////////////////////////////////////////////////////////////
+// Points in 3D
+
+class Point3 : public Object {
+ private:
+  Parameters getParameters () { return Parameters(p); }
+ protected:
+  PV3 p;
+ public:
+  PV3 getP () { return p; }
+  virtual Point3 * copy () const = 0;
+};
+
+typedef vector<Point3 *> Point3s;
+
+class InputPoint3 : public Point3 {
+ private:
+  Objects getObjects () { return Objects(); }
+  void calculate () {}
+ public:
+  InputPoint3 (const PV3 &ip) { p = ip; }
+  // Perturbed in creation order; for one thread reading its input in
+  // a fixed order only.
+  InputPoint3 (double x, double y, double z) { p = PV3(x, y, z); }
+  // Perturbed by id rather than by creation order; see Parameter::input.
+  InputPoint3 (double x, double y, double z, unsigned long long id) {
+    p = PV3(Parameter::input(x, 3*id), Parameter::input(y, 3*id + 1), Parameter::input(z, 3*id + 2));
+  }
+  InputPoint3 * copy () const { return new InputPoint3(p); }
+};
+
+// Where the line through o and d meets the plane of a, b and c.
+class PlaneIntersection : public Point3 {
+ private:
+  Objects getObjects () { return Objects(o, d, a, b, c); }
+  void calculate () {
+    PV3 po = o->getP(), u = d->getP() - po, pa = a->getP();
+    PV3 n = (b->getP() - pa).cross(c->getP() - pa);
+    p = po + u*(n.dot(pa - po)/n.dot(u));
+  }
+ protected:
+  Point3 *o, *d, *a, *b, *c;
+ public:
+  PlaneIntersection (Point3 *o, Point3 *d, Point3 *a, Point3 *b, Point3 *c)
+    : o(o), d(d), a(a), b(b), c(c) { calculate(); }
+  PlaneIntersection * copy () const { return new PlaneIntersection(o, d, a, b, c); }
+};
+
+// Sign of (a - d) . ((b - d) x (c - d)): which side of the plane of b,
+// c and d point a is on.
+Predicate4(Orient3D, Point3*, a, Point3*, b, Point3*, c, Point3*, d);
+
+// 1 if h comes before g on the line from o through d.
+Predicate4(RayOrder, Point3*, o, Point3*, d, Point3*, h, Point3*, g);
+
+///////////////////////////////////////////////////////////////////////////////////
+// Triangles
+
+class Triangle {
+ public:
+  Triangle (Point3 *a, Point3 *b, Point3 *c) { p[0] = a; p[1] = b; p[2] = c; }
+  // Segment q0 q1 crosses the triangle.
+  bool intersects (Point3 *q0, Point3 *q1);
+  // The ray from o through d crosses the triangle.
+  bool hitBy (Point3 *o, Point3 *d);
+
+  Point3 *p[3];
+
+ private:
+  // Sign of the line through q0 and q1 against the three edges, or 0 if
+  // they differ and the line misses the triangle.
+  int edgeSign (Point3 *q0, Point3 *q1);
+  bool isVertex (Point3 *q) { return q == p[0] || q == p[1] || q == p[2]; }
+};
+
+typedef vector<Triangle *> Triangles;
+
+bool naiveIntersects (Triangles &triangles, Point3 *q0, Point3 *q1);
+// The first triangle hit by the ray from o through d, or 0, by testing
+// them all.
+Triangle * naiveFirstHit (Triangles &triangles, Point3 *o, Point3 *d);
+
+///////////////////////////////////////////////////////////////////////////////////
+// Kd-tree of triangles
+//
+// Split by axis-aligned planes placed by the surface area heuristic
+// (MacDonald and Booth): a node of area A holding n triangles is split
+// at the plane that minimizes
+//   traversalCost + intersectCost*(A_L*n_L + A_R*n_R)/A,
+// scaled by 1 - emptyBonus if one side is empty, unless that is no
+// better than intersectCost*n.  Candidate planes are the faces of the
+// triangles' bounding boxes.  A triangle goes to every child its box
+// touches.
+//
+// Traversal is in doubles with a margin, so that it may visit a node it
+// need not but never skips one it must.  The triangles in the leaves are
+// tested with exact ACP predicates.  A triangle that has an endpoint of
+// the query as a vertex is not counted as hit.
+
+class TriangleKdTree {
+ public:
+  TriangleKdTree ();
+  ~TriangleKdTree ();
+  void build (Triangles &triangles);
+  // Any triangle crossed by segment q0 q1, as for line of sight.
+  bool intersects (Point3 *q0, Point3 *q1);
+  // Any triangle hit by the ray from o through d, as for occlusion.
+  bool anyHit (Point3 *o, Point3 *d);
+  // The first triangle hit by the ray from o through d, or 0.  Its hit
+  // point is PlaneIntersection(o, d, t->p[0], t->p[1], t->p[2]).
+  Triangle * firstHit (Point3 *o, Point3 *d);
+  int depth ();
+  int size () const { return triangles.size(); }
+
+  double traversalCost, intersectCost, emptyBonus;
+  int maxLeafSize;
+
+ private:
+  struct Box {
+    double lo[3], hi[3];
+    double area () const;
+  };
+
+  struct Node {
+    Node () : axis(-1), split(0), left(0), right(0) {}
+    ~Node () { delete left; delete right; }
+    int axis;	// -1 for a leaf
+    double split;
+    Node *left, *right;
+    vector<int> triangles;
+  };
+
+  struct Query {
+    Point3 *q0, *q1;
+    double o[3], d[3];
+    double margin;
+    bool ray, any;
+    Triangle *best;
+    Point3 *hit;
+    double bestT;
+  };
+
+  Node * build (vector<int> &ids, const Box &box, int depth, int maxDepth);
+  Triangle * query (Point3 *q0, Point3 *q1, bool ray, bool any);
+  void visit (Node *node, double t0, double t1, Query &q);
+  void visitLeaf (Node *node, Query &q);
+  static int depth (Node *node);
+
+  TriangleKdTree (const TriangleKdTree &);
+  void operator= (const TriangleKdTree &);
+
+  Node *root;
+  Triangles triangles;
+  vector<Box> boxes;
+  Box bounds;
+};
+
+#endif
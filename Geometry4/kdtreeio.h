@@ -0,0 +1,69 @@
+#ifndef KDTREEIO
+#define KDTREEIO
+
+#include <stdio.h>
+#include <map>
+#include <vector>
+#include "kdtree.h"
+
+using namespace std;
+
+///////////////////////////////////////////////////////////////////////////////////
+// Serialized index
+//
+// The tree is written in pre-order, with '-' standing for an empty
+// child.  Every point is written once, before the first record that
+// refers to it: input points as their perturbed coordinate intervals,
+// derived points as their type and the ids of the points they are
+// calculated from.  A node whose segment is a piece of a split one also
+// refers to the endpoints of the whole segment, and the pieces of one
+// segment get one LineSegment for it when read, so that a loaded tree
+// tests and mailboxes pieces as the built one does.  Reading the file
+// back gives bit-identical predicate results.  (The partitions of
+// externalBuild read the input separately, so there a segment that
+// crosses partitions has one whole per partition.)
+
+class IndexWriter {
+ public:
+  IndexWriter (FILE *f) : f(f), nPoints(0) {}
+  void header ();
+  int writePoint (Point *p);
+  void writeNode (KdTreeNode *node);
+  void writeEmpty ();
+  void writeTree (KdTreeNode *node);
+  void forget (Point *p) { ids.erase(p); }
+
+  FILE *f;
+  map<Point *, int> ids;
+  int nPoints;
+};
+
+class IndexReader {
+ public:
+  IndexReader (FILE *f) : f(f), failed(false) {}
+  bool header ();
+  // Points and segments come from Arena::active, if set; nodes from
+  // the heap.
+  KdTreeNode * readTree ();
+
+  FILE *f;
+  vector<Point *> points;
+  // The whole segments read, by endpoints.
+  map<pair<Point *, Point *>, LineSegment *> segments;
+  bool failed;
+
+ private:
+  Point * readPoint (char type);
+  Point * point ();
+  LineSegment * segment (Point *p0, Point *p1);
+};
+
+// Out-of-core construction.  Builds the index for the line segments in
+// inputFile, one "x0 y0 x1 y1" per line, and writes it to indexFile.
+// The top levels of the tree are chosen from a sample, the input is
+// partitioned on disk by those splits, and each partition is built and
+// written out on its own, so that no more than about memoryBudget bytes
+// of geometry are in memory at once.  Load the result with KdTree::load.
+bool externalBuild (const char *inputFile, const char *indexFile, size_t memoryBudget, const char *tmpDir = ".");
+
+#endif
@@ -0,0 +1,136 @@
+#ifndef KERNEL
+#define KERNEL
+
+#include <cfloat>
+#include <cmath>
+#include "kdtree.h"
+#include "intkernel.h"
+
+///////////////////////////////////////////////////////////////////////////////////
+// Kernels for KdTreeT besides AcpKernel; see kdtree.h for the interface.
+
+// Exact integer arithmetic on GridSegments.
+struct GridKernel {
+  typedef GridSegment *Segment;
+  typedef long long Split;
+
+  static Split splitAt (Segment l, int splitType) { return gridSplitValue(*l, splitType); }
+
+  static int classify (Segment l, Split s, int splitType) { return gridClassify(*l, splitType, s); }
+
+  static void split (Segment l, Split s, int splitType, Segment *l0, Segment *l1) {
+    *l0 = new (Arena::active) GridSegment;
+    *l1 = new (Arena::active) GridSegment;
+    gridSplit(*l, splitType, s, **l0, **l1);
+  }
+
+  static void beginQuery () {}
+
+  static bool intersects (Segment s, Segment l) { return gridIntersects(*s, *l); }
+
+  static bool less (Segment l, Segment m, int axis) {
+    return l->p[0][axis].compare(m->p[0][axis]) < 0;
+  }
+
+  static double coordinate (Split s, int axis) { return s; }
+
+  static double coordinate (Segment l, int end, int axis) {
+    const GridValue &v = l->p[end][axis];
+    return v.n/(double) v.d;
+  }
+};
+
+// A piece p[0] - p[1] of the input segment a - b in doubles, as
+// GridSegment.  The split points are rounded.
+struct DoubleSegment {
+  DoubleSegment () {}
+  DoubleSegment (double ax, double ay, double bx, double by) {
+    a[0] = ax; a[1] = ay; b[0] = bx; b[1] = by;
+    p[0][0] = ax; p[0][1] = ay; p[1][0] = bx; p[1][1] = by;
+  }
+
+  // Bound on the rounding error of a split point of the input segment.
+  double slack () const {
+    double m = max(max(fabs(a[0]), fabs(a[1])), max(fabs(b[0]), fabs(b[1])));
+    return 16.0*DBL_EPSILON*m;
+  }
+
+  double a[2], b[2];
+  double p[2][2];
+};
+
+typedef vector<DoubleSegment> DoubleSegments;
+
+// Double arithmetic on DoubleSegments.  Pieces are classified against a
+// split with a margin that covers the rounding of their endpoints, so
+// that the tree never sends a query down the wrong side.  If filtered,
+// the intersection test is exact (segmentsCross on the input
+// segments); otherwise it is a plain double orientation test, which can
+// be wrong for nearly degenerate segments.
+template <bool filtered>
+struct DoubleKernelT {
+  typedef DoubleSegment *Segment;
+  typedef double Split;
+
+  static Split splitAt (Segment l, int splitType) { return l->p[0][splitType]; }
+
+  static int classify (Segment l, Split s, int splitType) {
+    double e = l->slack(), c0 = l->p[0][splitType], c1 = l->p[1][splitType];
+    if (c0 < s - e && c1 < s - e)
+      return 1;
+    if (c0 > s + e && c1 > s + e)
+      return -1;
+    return 0;
+  }
+
+  static void split (Segment l, Split s, int splitType, Segment *l0, Segment *l1) {
+    DoubleSegment *below = new (Arena::active) DoubleSegment(*l);
+    DoubleSegment *above = new (Arena::active) DoubleSegment(*l);
+    *l0 = below;
+    *l1 = above;
+    double da = l->b[splitType] - l->a[splitType];
+    if (da == 0.0)
+      return;
+    // Where the input segment crosses the line.
+    int other = 1 - splitType;
+    double t = (s - l->a[splitType])/da;
+    t = t < 0.0 ? 0.0 : t > 1.0 ? 1.0 : t;
+    double q[2];
+    q[splitType] = s;
+    q[other] = l->a[other] + t*(l->b[other] - l->a[other]);
+    int first = l->p[0][splitType] < l->p[1][splitType] ? 0 : 1;
+    below->p[0][0] = l->p[first][0];
+    below->p[0][1] = l->p[first][1];
+    above->p[0][0] = l->p[1 - first][0];
+    above->p[0][1] = l->p[1 - first][1];
+    below->p[1][0] = above->p[1][0] = q[0];
+    below->p[1][1] = above->p[1][1] = q[1];
+  }
+
+  static void beginQuery () {}
+
+  static bool intersects (Segment s, Segment l) {
+    if (filtered)
+      return segmentsCross(s->a[0], s->a[1], s->b[0], s->b[1],
+                           l->a[0], l->a[1], l->b[0], l->b[1]) == 1;
+    return orient(s->a, l->a, l->b) != orient(s->b, l->a, l->b) &&
+      orient(l->a, s->a, s->b) != orient(l->b, s->a, s->b);
+  }
+
+  static bool less (Segment l, Segment m, int axis) { return l->p[0][axis] < m->p[0][axis]; }
+
+  static double coordinate (Split s, int axis) { return s; }
+
+  static double coordinate (Segment l, int end, int axis) { return l->p[end][axis]; }
+
+  // Sign of (c - b) x (a - b) in doubles.
+  static int orient (const double *a, const double *b, const double *c) {
+    double t = (c[0] - b[0])*(a[1] - b[1]) - (c[1] - b[1])*(a[0] - b[0]);
+    return t > 0.0 ? 1 : t < 0.0 ? -1 : 0;
+  }
+};
+
+typedef DoubleKernelT<true> FilteredKernel;
+typedef DoubleKernelT<false> DoubleKernel;
+
+#endif
@@ -26,64 +26,108 @@ pages 37-52, 2012
 #define OBJECT_H
 
 #include "pv.h"
-#include <vector>
+#include <atomic>
+#if defined(_WIN32)
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
 
 namespace acp {
 
-// List of parameters.
+// List of parameters.  Held inline, so building one never allocates.
 class Parameters {
-  std::vector <Parameter *> parameters;
+  enum { capacity = 8 };
+  Parameter *parameters[capacity];
+  int n;
 
 public:
-  Parameters () : parameters(0) {}
-  Parameters (Parameter &p) : parameters(1) { parameters[0] = &p; }
-  Parameters (PV2 &v) : parameters(2) { parameters[0] = &v.x; parameters[1] = &v.y; }
-  Parameters (PV3 &v) : parameters(3) { parameters[0] = &v.x; parameters[1] = &v.y; parameters[2] = &v.z; }
-  Parameters (Parameter &p, PV2 &v) : parameters(3) { parameters[0] = &p; parameters[1] = &v.x; parameters[2] = &v.y; }
-  Parameters (PV3 &v, Parameter &p) : parameters(4) { parameters[0] = &v.x; parameters[1] = &v.y; parameters[2] = &v.z; parameters[3] = &p; }
-
-  Parameters add (Parameter &p) { parameters.push_back(&p); return *this; }
-  Parameters add (PV2 &v) { parameters.push_back(&v.x); parameters.push_back(&v.y); return *this; }
-  Parameters add (PV3 &v) { parameters.push_back(&v.x); parameters.push_back(&v.y); parameters.push_back(&v.z); return *this; }
-
-  int size () { return parameters.size(); }
+  Parameters () : n(0) {}
+  Parameters (Parameter &p) : n(1) { parameters[0] = &p; }
+  Parameters (PV2 &v) : n(2) { parameters[0] = &v.x; parameters[1] = &v.y; }
+  Parameters (PV3 &v) : n(3) { parameters[0] = &v.x; parameters[1] = &v.y; parameters[2] = &v.z; }
+  Parameters (Parameter &p, PV2 &v) : n(3) { parameters[0] = &p; parameters[1] = &v.x; parameters[2] = &v.y; }
+  Parameters (PV3 &v, Parameter &p) : n(4) { parameters[0] = &v.x; parameters[1] = &v.y; parameters[2] = &v.z; parameters[3] = &p; }
+
+  Parameters add (Parameter &p) { push(&p); return *this; }
+  Parameters add (PV2 &v) { push(&v.x); push(&v.y); return *this; }
+  Parameters add (PV3 &v) { push(&v.x); push(&v.y); push(&v.z); return *this; }
+
+  int size () { return n; }
   Parameter *get (int i) { return parameters[i]; }
+
+private:
+  void push (Parameter *p) { assert(n < capacity); parameters[n++] = p; }
 };
 
 class Object;
 
-// List of objects.
+// List of objects.  Held inline, so building one never allocates.
 class Objects {
-  std::vector<Object *> objects;
+  enum { capacity = 10 };
+  Object *objects[capacity];
+  int n;
 
 public:
-  Objects () : objects(0) {}
-  Objects (Object *o0) : objects(1) { objects[0] = o0; }
-  Objects (Object *o0, Object *o1) : objects(2) { objects[0] = o0; objects[1] = o1; }
-  Objects (Object *o0, Object *o1, Object *o2) : objects(3) { objects[0] = o0; objects[1] = o1; objects[2] = o2; }
-  Objects (Object *o0, Object *o1, Object *o2, Object *o3) : objects(4) { objects[0] = o0; objects[1] = o1; objects[2] = o2; objects[3] = o3; }
-  Objects (Object *o0, Object *o1, Object *o2, Object *o3, Object *o4) : objects(5) { objects[0] = o0; objects[1] = o1; objects[2] = o2; objects[3] = o3; objects[4] = o4; }
-  Objects (Object *o0, Object *o1, Object *o2, Object *o3, Object *o4, Object *o5) : objects(6) { objects[0] = o0; objects[1] = o1; objects[2] = o2; objects[3] = o3; objects[4] = o4; objects[5] = o5; }
-  Objects (Object *o0, Object *o1, Object *o2, Object *o3, Object *o4, Object *o5, Object *o6) : objects(7) { objects[0] = o0; objects[1] = o1; objects[2] = o2; objects[3] = o3; objects[4] = o4; objects[5] = o5; objects[6] = o6; }
-  Objects (Object *o0, Object *o1, Object *o2, Object *o3, Object *o4, Object *o5, Object *o6, Object *o7) : objects(8) { objects[0] = o0; objects[1] = o1; objects[2] = o2; objects[3] = o3; objects[4] = o4; objects[5] = o5; objects[6] = o6; objects[7] = o7; }
-  Objects (Object *o0, Object *o1, Object *o2, Object *o3, Object *o4, Object *o5, Object *o6, Object *o7, Object *o8) : objects(9) { objects[0] = o0; objects[1] = o1; objects[2] = o2; objects[3] = o3; objects[4] = o4; objects[5] = o5; objects[6] = o6; objects[7] = o7; objects[8] = o8; }
-  Objects (Object *o0, Object *o1, Object *o2, Object *o3, Object *o4, Object *o5, Object *o6, Object *o7, Object *o8, Object *o9) : objects(10) { objects[0] = o0; objects[1] = o1; objects[2] = o2; objects[3] = o3; objects[4] = o4; objects[5] = o5; objects[6] = o6; objects[7] = o7; objects[8] = o8; objects[9] = o9; }
-
-  void add (Object *o) { objects.push_back(o); }
-
-  int size () { return objects.size(); }
+  Objects () : n(0) {}
+  Objects (Object *o0) : n(1) { objects[0] = o0; }
+  Objects (Object *o0, Object *o1) : n(2) { objects[0] = o0; objects[1] = o1; }
+  Objects (Object *o0, Object *o1, Object *o2) : n(3) { objects[0] = o0; objects[1] = o1; objects[2] = o2; }
+  Objects (Object *o0, Object *o1, Object *o2, Object *o3) : n(4) { objects[0] = o0; objects[1] = o1; objects[2] = o2; objects[3] = o3; }
+  Objects (Object *o0, Object *o1, Object *o2, Object *o3, Object *o4) : n(5) { objects[0] = o0; objects[1] = o1; objects[2] = o2; objects[3] = o3; objects[4] = o4; }
+  Objects (Object *o0, Object *o1, Object *o2, Object *o3, Object *o4, Object *o5) : n(6) { objects[0] = o0; objects[1] = o1; objects[2] = o2; objects[3] = o3; objects[4] = o4; objects[5] = o5; }
+  Objects (Object *o0, Object *o1, Object *o2, Object *o3, Object *o4, Object *o5, Object *o6) : n(7) { objects[0] = o0; objects[1] = o1; objects[2] = o2; objects[3] = o3; objects[4] = o4; objects[5] = o5; objects[6] = o6; }
+  Objects (Object *o0, Object *o1, Object *o2, Object *o3, Object *o4, Object *o5, Object *o6, Object *o7) : n(8) { objects[0] = o0; objects[1] = o1; objects[2] = o2; objects[3] = o3; objects[4] = o4; objects[5] = o5; objects[6] = o6; objects[7] = o7; }
+  Objects (Object *o0, Object *o1, Object *o2, Object *o3, Object *o4, Object *o5, Object *o6, Object *o7, Object *o8) : n(9) { objects[0] = o0; objects[1] = o1; objects[2] = o2; objects[3] = o3; objects[4] = o4; objects[5] = o5; objects[6] = o6; objects[7] = o7; objects[8] = o8; }
+  Objects (Object *o0, Object *o1, Object *o2, Object *o3, Object *o4, Object *o5, Object *o6, Object *o7, Object *o8, Object *o9) : n(10) { objects[0] = o0; objects[1] = o1; objects[2] = o2; objects[3] = o3; objects[4] = o4; objects[5] = o5; objects[6] = o6; objects[7] = o7; objects[8] = o8; objects[9] = o9; }
+
+  void add (Object *o) { assert(n < capacity); objects[n++] = o; }
+
+  int size () { return n; }
   Object *get (int i) { return objects[i]; }
 };
 
 class Predicate;
 class AnglePoly;
 
+// High-precision values of a derived Object, kept after its precision
+// is decreased so that the next escalation of the same Object can
+// restore them instead of recalculating its ancestors.  The table is
+// direct mapped, so it holds at most memoSize entries per thread.
+// Entries from an older memoGeneration are ignored.  memoWrites counts
+// the entries the thread has written, so that an Arena can tell whether
+// any of them may be for an Object it frees.
+struct MemoEntry {
+  enum { capacity = 8 };
+  MemoEntry () : object(0), generation(0), precision(0) {}
+  Object *object;
+  unsigned int generation, precision;
+  Parameter values[capacity];
+};
+
+static const int memoSize = 1024;
+extern ACP_THREAD MemoEntry *memoTable;
+extern std::atomic<unsigned int> memoGeneration;
+extern ACP_THREAD unsigned long long memoWrites;
+
+inline MemoEntry & memoEntry (Object *o)
+{
+  if (memoTable == 0)
+    memoTable = new MemoEntry[memoSize];
+  size_t h = (size_t) o;
+  h ^= h >> 13;
+  return memoTable[(h >> 3) & (memoSize - 1)];
+}
+
 // Use this as the parent class for all your geometric objects:
 // points, lines, etc.
 // Your class must define getParameters(), getObjects(), and calculate().
 class Object {
 public:
   Object () {}
+  // Objects are deleted through base pointers, as Points are.
+  virtual ~Object () {}
 
   // Parameters defined in this Object.
   virtual Parameters getParameters () = 0;
@@ -98,6 +142,17 @@ public:
     assert(getObjects().size() == 0 || getParameters().size() == 0);
   }
 
+  // Set to false to always recalculate derived Objects on escalation.
+  static bool memoize;
+
+  // Call after deleting Objects, before their addresses can be reused.
+  // Drops the memos of every thread.
+  static void forgetMemos () { ++memoGeneration; }
+
+  // Drop the calling thread's memos of Objects in [begin, end), as when
+  // its arena frees them.  Other memos are kept.
+  static void forgetMemos (const char *begin, const char *end);
+
   friend class Predicate;
   friend class AnglePoly;
 private:
@@ -108,12 +163,34 @@ private:
     Parameters parameters = getParameters();
     if (parameters.size() > 0 && parameters.get(0)->increased())
       return;
+    Objects objects = getObjects();
+    bool memo = memoize && objects.size() > 0 && parameters.size() > 0 &&
+      parameters.size() <= MemoEntry::capacity;
+    unsigned int precision = context.highPrecision;
+    if (memo) {
+      MemoEntry &e = memoEntry(this);
+      if (e.object == this && e.generation == memoGeneration &&
+          e.precision == precision) {
+        for (int i = 0; i < parameters.size(); i++)
+          parameters.get(i)->restorePrecision(e.values[i]);
+        return;
+      }
+    }
     for (int i = 0; i < parameters.size(); i++)
       parameters.get(i)->increasePrecision();
-    Objects objects = getObjects();
     for (int i = 0; i < objects.size(); i++)
       objects.get(i)->increasePrecision();
     calculate();
+    // Values calculated after a sign failure are not to be trusted.
+    if (memo && !context.failed) {
+      MemoEntry &e = memoEntry(this);
+      e.object = this;
+      e.generation = memoGeneration;
+      ++memoWrites;
+      e.precision = precision;
+      for (int i = 0; i < parameters.size(); i++)
+        e.values[i] = *parameters.get(i);
+    }
   }
 
   void decreasePrecision () {
@@ -128,6 +205,31 @@ private:
   }
 };
 
+// Readers-writer lock.
+class RWLock {
+public:
+#if defined(_WIN32)
+  RWLock () { InitializeSRWLock(&lock); }
+  void lockShared () { AcquireSRWLockShared(&lock); }
+  void unlockShared () { ReleaseSRWLockShared(&lock); }
+  void lockExclusive () { AcquireSRWLockExclusive(&lock); }
+  void unlockExclusive () { ReleaseSRWLockExclusive(&lock); }
+private:
+  SRWLOCK lock;
+#else
+  RWLock () { pthread_rwlock_init(&lock, 0); }
+  ~RWLock () { pthread_rwlock_destroy(&lock); }
+  void lockShared () { pthread_rwlock_rdlock(&lock); }
+  void unlockShared () { pthread_rwlock_unlock(&lock); }
+  void lockExclusive () { pthread_rwlock_wrlock(&lock); }
+  void unlockExclusive () { pthread_rwlock_unlock(&lock); }
+private:
+  pthread_rwlock_t lock;
+#endif
+};
+
+extern RWLock escalationLock;
+
 // All predicates should be derived from the Predicate class
 // and define the getObjects() method and sign() method.
 // Use it like this:
@@ -136,22 +238,107 @@ class Predicate {
   // Calculate the sign from the objects.
   virtual int sign () = 0;
 
+  // Holds escalationLock for the rest of the evaluation.
+  class Guard {
+  public:
+    Guard (bool exclusive) : exclusive(exclusive) {
+      if (exclusive)
+        escalationLock.lockExclusive();
+      else
+        escalationLock.lockShared();
+      context.locked = true;
+    }
+    ~Guard () {
+      context.locked = false;
+      if (exclusive)
+        escalationLock.unlockExclusive();
+      else
+        escalationLock.unlockShared();
+    }
+  private:
+    bool exclusive;
+  };
+
+  // Counts this Predicate in context.predicates, so that sign failures
+  // set context.failed instead of throwing, and restores the caller's
+  // failed flag afterwards.
+  class Scope {
+  public:
+    Scope () : failed(context.failed) { ++context.predicates; }
+    ~Scope () {
+      --context.predicates;
+      context.failed = failed;
+    }
+  private:
+    bool failed;
+  };
+
+  // Try sign() once.  Returns false if it failed.
+  bool attempt (int &s) {
+    Scope scope;
+    context.failed = false;
+    s = sign();
+    return !context.failed;
+  }
+
+  // Objects raised n levels above their normal precision.  Lowered
+  // again on the way out, also if PrecisionException is thrown.
+  class Escalation {
+  public:
+    Escalation (const Objects &objects) : objects(objects), n(0) {}
+    ~Escalation () {
+      for (; n > 0; n--)
+        for (int i = 0; i < objects.size(); i++)
+          objects.get(i)->decreasePrecision();
+    }
+    void increase () {
+      for (int i = 0; i < objects.size(); i++)
+        objects.get(i)->increasePrecision();
+      n++;
+    }
+  private:
+    Objects objects;
+    int n;
+  };
+
+  int evaluate () {
+    Scope scope;
+    context.failed = false;
+    int s = sign();
+    if (!context.failed)
+      return s;
+    Escalation escalation(getObjects());
+    do {
+      // A failure while recalculating the objects escalates again.
+      context.failed = false;
+      escalation.increase();
+      if (!context.failed)
+        s = sign();
+    } while (context.failed);
+    return s;
+  }
+
 public:
   // Objects on which this Predicate depends.
   virtual Objects getObjects () = 0;
 
+  // Set to true before evaluating predicates in several threads at
+  // once.  Escalation recalculates shared Objects in place, so it then
+  // runs alone: evaluation holds escalationLock shared and escalation
+  // holds it exclusively.
+  static bool concurrent;
+
   operator int () {
-    try {
-      return sign();
-    } catch (SignException se) {
-      Objects objects = getObjects();
-      for (int i = 0; i < objects.size(); i++)
-        objects.get(i)->increasePrecision();
-      int ret = operator int();
-      for (int i = 0; i < objects.size(); i++)
-        objects.get(i)->decreasePrecision();
-      return ret;
+    if (!concurrent || context.locked)
+      return evaluate();
+    {
+      Guard guard(false);
+      int s;
+      if (attempt(s))
+        return s;
     }
+    Guard guard(true);
+    return evaluate();
   }
 };  
 
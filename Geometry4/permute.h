@@ -8,4 +8,23 @@ void randomPermutation (int n, int *p);
 
 int randomInteger (int lb, int ub);
 
+// Position of cell (x, y) of a 2^16 by 2^16 grid along the Morton
+// (Z-order) curve and along the Hilbert curve.
+unsigned int mortonKey (unsigned int x, unsigned int y);
+unsigned int hilbertKey (unsigned int x, unsigned int y);
+
+// keys[i] is the position of point (x[i], y[i]) along the Hilbert
+// curve, or the Morton curve if !hilbert, over the square on the longer
+// side of the bounding box of the n points.  The Morton key has y in
+// its top bit.
+void curveKeys (int n, const double *x, const double *y, bool hilbert, unsigned int *keys);
+
+// p orders the n points along the curve.
+void curvePermutation (int n, const double *x, const double *y, bool hilbert, int *p);
+
+// Sort keys[0..n) with values alongside, stably, by radix sort on
+// bytes.  The counting and the scattering of each pass are split among
+// threads, or among all processors if threads <= 0.
+void radixSort (int n, unsigned int *keys, int *values, int threads = 0);
+
 #endif
@@ -2,6 +2,7 @@
 #define POINT
 
 #include "object.h"
+#include "storage.h"
 #include <vector>
 #include <iomanip>
 
@@ -15,7 +16,21 @@ class Point : public Object {
   PV2 p;
  public:
   PV2 getP () { return p; }
+  // The coordinates as plain doubles, if they are exact.
+  bool exact (double &x, double &y) const {
+    if (!p.x.exact() || !p.y.exact())
+      return false;
+    x = p.x.lb();
+    y = p.y.lb();
+    return true;
+  }
   virtual Point * copy () const = 0;
+  // The point whose coordinate axis (0 for x, 1 for y) this one takes
+  // by construction, as a split point takes that of the point it was
+  // split at; this point if none.  Points with the same source are on
+  // one axis-parallel line exactly, which XOrder or YOrder cannot
+  // decide.
+  virtual Point * source (int axis) { return this; }
 };
 
 typedef vector<Point *> Points;
@@ -28,16 +43,59 @@ Predicate2(CCW, Point*, a, Point*, b);
 
 Predicate3(LeftTurn, Point*, a, Point*, b, Point*, c);
 
+// 1 if segment ab crosses segment cd, -1 if not.  The same as testing
+// LeftTurn(a, c, d) != LeftTurn(b, c, d) && LeftTurn(c, a, b) !=
+// LeftTurn(d, a, b), but the four share their differences and escalate
+// together.
+Predicate4(SegmentsCross, Point*, a, Point*, b, Point*, c, Point*, d);
+
+// LeftTurn and SegmentsCross on exact double coordinates, as for input
+// points.  Exact, so they never escalate; 0 only for true degeneracy.
+int leftTurn (double ax, double ay, double bx, double by, double cx, double cy);
+int segmentsCross (double ax, double ay, double bx, double by,
+                   double cx, double cy, double dx, double dy);
+
 class InputPoint : public Point {
  private:
   Objects getObjects () { return Objects(); }
   void calculate () {}
  public:
   InputPoint (const PV2 &ip) { p = ip; }
+  // Perturbed in creation order; for one thread reading its input in
+  // a fixed order only.
   InputPoint (double x, double y) { p = PV2(x, y); }
+  // Perturbed by id rather than by creation order; see Parameter::input.
+  InputPoint (double x, double y, unsigned long long id) {
+    p = PV2(Parameter::input(x, 2*id), Parameter::input(y, 2*id + 1));
+  }
   InputPoint * copy () const { return new InputPoint(p); }
 };
 
+// Input points by value, as two arrays of perturbed coordinates.  Point
+// i has the coordinates InputPoint(x, y, i) would have, in 16 bytes
+// instead of a heap Object.  It becomes an InputPoint only when
+// object(i) is asked for it, for a derived point or a Predicate.
+class PointStore {
+ public:
+  PointStore () {}
+  ~PointStore ();
+  int add (double px, double py);
+  int size () const { return x.size(); }
+  // Drop points n and above.
+  void truncate (int n);
+  PV2 getP (int i) const { return PV2(Parameter::constant(x[i]), Parameter::constant(y[i])); }
+  Point * object (int i);
+
+  // On huge pages if Storage::hugePages is set.
+  vector<double, HugePageAllocator<double> > x, y;
+
+ private:
+  PointStore (const PointStore &);
+  void operator= (const PointStore &);
+
+  vector<InputPoint *> objects;
+};
+
 class Vector : public Point {
  private:
   Objects getObjects () { return Objects(t, h); }
@@ -76,6 +134,7 @@ class LineIntersection : public Point {
   LineIntersection * copy () const { return new LineIntersection(a, b, c, d); }
 };
 
+// Where line ab meets the line through c parallel to the x axis.
 PV2 lineIntersectionWithXAxis (const PV2 &a, const PV2 &b, const PV2 &c);
 
 class LineIntersectionWithXAxis : public Point {
@@ -90,8 +149,10 @@ class LineIntersectionWithXAxis : public Point {
   LineIntersectionWithXAxis (Point *a, Point *b, Point *c) 
     : a(a), b(b), c(c) { calculate(); }
   LineIntersectionWithXAxis * copy () const { return new LineIntersectionWithXAxis(a, b, c); }
+  Point * source (int axis) { return axis == 1 ? c->source(1) : this; }
 };
 
+// Where line ab meets the line through c parallel to the y axis.
 PV2 lineIntersectionWithYAxis (const PV2 &a, const PV2 &b, const PV2 &c);
 
 class LineIntersectionWithYAxis : public Point {
@@ -106,6 +167,7 @@ class LineIntersectionWithYAxis : public Point {
   LineIntersectionWithYAxis (Point *a, Point *b, Point *c) 
     : a(a), b(b), c(c) { calculate(); }
   LineIntersectionWithYAxis * copy () const { return new LineIntersectionWithYAxis(a, b, c); }
+  Point * source (int axis) { return axis == 0 ? c->source(0) : this; }
 };
 
 void pp (Point *p);
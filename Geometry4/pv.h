@@ -18,8 +18,8 @@ public:
   bool uninitialized () { return x.uninitialized() && y.uninitialized(); }
   Parameter getX () const { return x; }
   Parameter getY () const { return y; }
-  Parameter dot (const PV2 &b) const { return x*b.x + y*b.y; }
-  Parameter cross (const PV2 &b) const { return x*b.y - y*b.x; }
+  Parameter dot (const PV2 &b) const { return Parameter::sumProducts(x, b.x, y, b.y); }
+  Parameter cross (const PV2 &b) const { return Parameter::diffProducts(x, b.y, y, b.x); }
   PV2 operator+ (const PV2 &b) const { return PV2(x + b.x, y + b.y); }
   PV2 operator- (const PV2 &b) const { return PV2(x - b.x, y - b.y); }
   PV2 operator- () const { return PV2(- x, - y); }    
@@ -63,7 +63,10 @@ class PV3 {
   Parameter getZ () const { return z; }
 
   Parameter dot (const PV3 &b) const { 
-    return x*b.x + y*b.y + z*b.z; 
+    Parameter s = x*b.x;
+    s += y*b.y;
+    s += z*b.z;
+    return s;
   }
 
   PV3 operator+ (const PV3 &b) const {
@@ -72,9 +72,13 @@ inline bool qd_real::isnan() const {
 }
 
 /********** Renormalization **********/
-// ACP controlled rounding
+// ACP controlled rounding, per thread
 namespace acp {
-  extern int qd_round;
+#if defined(_MSC_VER)
+  extern __declspec(thread) int qd_round;
+#else
+  extern __thread int qd_round;
+#endif
 }
 
 namespace qd {
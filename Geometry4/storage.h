@@ -0,0 +1,75 @@
+#ifndef STORAGE
+#define STORAGE
+
+#include <stddef.h>
+#include <new>
+
+///////////////////////////////////////////////////////////////////////////////////
+// Storage for large trees
+//
+// Arrays of tens of millions of nodes or points spend much of a query in
+// TLB misses.  HugePageAllocator puts the large ones on 2MB pages if
+// Storage::hugePages asks for them; small ones, and all of them by
+// default, come from the heap.  Pages are asked for when an array is
+// allocated, so set the mode before building.  Only Linux has huge
+// pages here; elsewhere the mode is ignored.
+
+enum HugePageMode {
+  noHugePages,
+  // madvise(MADV_HUGEPAGE), if transparent huge pages are enabled.
+  transparentHugePages,
+  // MAP_HUGETLB from the pool in /proc/sys/vm/nr_hugepages, else as
+  // transparentHugePages.
+  explicitHugePages
+};
+
+class Storage {
+ public:
+  static void * allocate (size_t size);
+  static void free (void *p);
+
+  static HugePageMode hugePages;
+  // Smaller arrays are not put on huge pages.
+  static size_t hugePageThreshold;
+};
+
+// An STL allocator from Storage.
+template <class T>
+class HugePageAllocator {
+ public:
+  typedef T value_type;
+  typedef T *pointer;
+  typedef const T *const_pointer;
+  typedef T &reference;
+  typedef const T &const_reference;
+  typedef size_t size_type;
+  typedef ptrdiff_t difference_type;
+  template <class U> struct rebind { typedef HugePageAllocator<U> other; };
+
+  HugePageAllocator () {}
+  template <class U> HugePageAllocator (const HugePageAllocator<U> &) {}
+
+  pointer address (reference r) const { return &r; }
+  const_pointer address (const_reference r) const { return &r; }
+  pointer allocate (size_type n, const void * = 0) { return (pointer) Storage::allocate(n*sizeof(T)); }
+  void deallocate (pointer p, size_type) { Storage::free(p); }
+  size_type max_size () const { return size_t(-1)/sizeof(T); }
+  void construct (pointer p, const T &t) { new (p) T(t); }
+  void destroy (pointer p) { p->~T(); }
+};
+
+template <class T, class U>
+bool operator== (const HugePageAllocator<T> &, const HugePageAllocator<U> &) { return true; }
+
+template <class T, class U>
+bool operator!= (const HugePageAllocator<T> &, const HugePageAllocator<U> &) { return false; }
+
+// Hint that *p will be read soon.
+#if defined(_MSC_VER)
+#include <xmmintrin.h>
+#define PREFETCH(p) _mm_prefetch((const char *) (p), _MM_HINT_T0)
+#else
+#define PREFETCH(p) __builtin_prefetch(p)
+#endif
+
+#endif